@@ -0,0 +1 @@
+../src/camera_channel.h
\ No newline at end of file
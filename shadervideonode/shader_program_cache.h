@@ -0,0 +1 @@
+../src/shader_program_cache.h
\ No newline at end of file
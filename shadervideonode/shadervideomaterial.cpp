@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QAtomicInt>
 #include <QTransform>
 
 #include <QtCore/qdebug.h>
@@ -26,14 +27,20 @@
 #include <hybris/camera/camera_compatibility_layer.h>
 #include <hybris/media/surface_texture_client_hybris.h>
 
-ShaderVideoShader *ShaderVideoMaterial::m_videoShader = 0;
+static QAtomicInt s_textureMatrixGeneration;
 
 ShaderVideoMaterial::ShaderVideoMaterial(const QVideoSurfaceFormat &format)
     : m_format(format),
       m_camControl(0),
       m_textureId(0),
+      m_textureDirty(true),
+      m_textureMatrixGeneration(s_textureMatrixGeneration.fetchAndAddRelaxed(1) + 1),
+      m_variant(ShaderVideoShader::variant(format.pixelFormat())),
       m_surfaceTextureClient(0),
       m_videoSink(nullptr),
+      m_latchedFrames(0),
+      m_skippedLatches(0),
+      m_skippedSinkFrames(0),
       m_readyToRender(false),
       m_orientation(SharedSignal::Orientation::rotate0)
 {
@@ -67,16 +74,14 @@ ShaderVideoMaterial::ShaderVideoMaterial(const QVideoSurfaceFormat &format)
 
 QSGMaterialShader *ShaderVideoMaterial::createShader() const
 {
-    if (!m_videoShader) {
-        m_videoShader = new ShaderVideoShader(m_format.pixelFormat());
-    }
-    return m_videoShader;
+    // The scene graph keeps one shader per material type
+    return new ShaderVideoShader(m_variant);
 }
 
 QSGMaterialType *ShaderVideoMaterial::type() const
 {
-    static QSGMaterialType theType;
-    return &theType;
+    static QSGMaterialType types[ShaderVideoShader::VariantCount];
+    return &types[m_variant];
 }
 
 void ShaderVideoMaterial::setCamControl(CameraControl *cc)
@@ -93,6 +98,8 @@ CameraControl *ShaderVideoMaterial::cameraControl() const
 
 void ShaderVideoMaterial::setTextureId(GLuint textureId)
 {
+    if (m_textureId != textureId)
+        m_textureDirty = true;
     m_textureId = textureId;
 }
 
@@ -103,7 +110,18 @@ void ShaderVideoMaterial::setSurfaceTextureClient(SurfaceTextureClientHybris sur
 
 void ShaderVideoMaterial::setGLVideoSink(VideoSink &sink)
 {
+    disconnect(m_videoSinkConnection);
+    disconnect(m_videoSinkErrorConnection);
     m_videoSink = &sink;
+    m_videoSinkConnection = connect(&sink, &VideoSink::frameAvailable, this,
+                                    [this](int skippedFrames) { frameAvailable(skippedFrames); },
+                                    Qt::DirectConnection);
+    // Passed on to the media service, which owns the player
+    m_videoSinkErrorConnection = connect(&sink, &VideoSink::error,
+                                         SharedSignal::instance(), &SharedSignal::sinkError,
+                                         Qt::DirectConnection);
+    // Buffers queued before the connection are latched on the next frame
+    frameAvailable();
 }
 
 VideoSink &ShaderVideoMaterial::glVideoSink() const
@@ -111,22 +129,48 @@ VideoSink &ShaderVideoMaterial::glVideoSink() const
     return *m_videoSink;
 }
 
-void ShaderVideoMaterial::updateTexture()
+/*!
+ * \brief ShaderVideoMaterial::updateTexture latches the newest buffer into
+ * the texture and updates the texture matrix, if a buffer newer than the
+ * latched one was queued
+ * \return true if a new buffer was latched
+ */
+bool ShaderVideoMaterial::updateTexture()
 {
     if (!m_camControl && !m_textureId && !m_videoSink) {
-        return;
+        return false;
+    }
+
+    if (!m_camControl && m_videoSink && !m_readyToRender) {
+        m_readyToRender = true;
+        return false;
+    }
+
+    // A presented camera frame can stand for several HAL frame callbacks, so
+    // camera buffers are counted from the callbacks themselves
+    const qint64 availableFrames = (m_camControl && m_cameraChannel)
+            ? m_cameraChannel->frameSequence()
+            : qint64(m_availableFrames.loadAcquire());
+    if (availableFrames == m_latchedFrames) {
+        m_skippedLatches++;
+        return false;
     }
+    const qint64 pendingFrames = availableFrames - m_latchedFrames;
+    m_latchedFrames = availableFrames;
 
     if (m_camControl != NULL) {
-        android_camera_update_preview_texture(m_camControl);
+        // Each update latches a single buffer: drain the ones queued since
+        // the last latch, so that the newest is drawn and the HAL gets its
+        // buffers back instead of blocking on them
+        const int latches = int(qBound<qint64>(1, pendingFrames, MaxCameraLatches));
+        for (int i = 0; i < latches; i++)
+            android_camera_update_preview_texture(m_camControl);
         android_camera_get_preview_texture_transformation(m_camControl, textureGLMatrix());
-    } else if (m_videoSink && !m_readyToRender) {
-        m_readyToRender = true;
-        return;
-    } else if (m_videoSink && m_readyToRender) {
-        if (m_videoSink->swapBuffers()) {
-            m_textureMatrix = m_videoSink->transformationMatrix();
+    } else if (m_videoSink) {
+        if (!m_videoSink->swapBuffers()) {
+            return false;
         }
+        m_textureMatrix = m_videoSink->transformationMatrix();
     }
 
     // See if the video needs rotation
@@ -140,6 +184,50 @@ void ShaderVideoMaterial::updateTexture()
     {
         undoAndroidYFlip(m_textureMatrix);
     }
+
+    updateTextureMatrixGeneration();
+    return true;
+}
+
+void ShaderVideoMaterial::frameAvailable(int skippedFrames)
+{
+    if (skippedFrames > 0)
+        m_skippedSinkFrames.fetchAndAddRelaxed(skippedFrames);
+    m_availableFrames.ref();
+}
+
+/*!
+ * \brief ShaderVideoMaterial::takeSkippedSinkFrames returns the number of
+ * frames the video sink dropped in favour of newer ones, since the previous
+ * call
+ */
+int ShaderVideoMaterial::takeSkippedSinkFrames()
+{
+    return m_skippedSinkFrames.fetchAndStoreRelaxed(0);
+}
+
+/*!
+ * \brief ShaderVideoMaterial::takeSkippedLatches returns the number of
+ * updates that found no new buffer since the last call
+ */
+int ShaderVideoMaterial::takeSkippedLatches()
+{
+    const int skipped = m_skippedLatches;
+    m_skippedLatches = 0;
+    return skipped;
+}
+
+/*!
+ * \brief ShaderVideoMaterial::updateTextureMatrixGeneration moves to a new
+ * generation if the texture matrix differs from the one last handed out
+ */
+void ShaderVideoMaterial::updateTextureMatrixGeneration()
+{
+    if (m_textureMatrix == m_uploadedTextureMatrix)
+        return;
+
+    m_uploadedTextureMatrix = m_textureMatrix;
+    m_textureMatrixGeneration = s_textureMatrixGeneration.fetchAndAddRelaxed(1) + 1;
 }
 
 void ShaderVideoMaterial::onSetOrientation(const SharedSignal::Orientation& orientation,
@@ -160,6 +248,8 @@ void ShaderVideoMaterial::onSinkReset()
     if (m_videoSink && m_readyToRender)
         m_videoSink->swapBuffers();
 
+    disconnect(m_videoSinkConnection);
+    disconnect(m_videoSinkErrorConnection);
     m_videoSink = nullptr;
     m_readyToRender = false;
 }
@@ -25,10 +25,12 @@
 #include <QtQuick/QSGMaterial>
 #endif
 #include <qopengl.h>
+#include <QAtomicInt>
 #include <QMatrix4x4>
 #include <QObject>
 #include <QPointer>
 #include <QVideoSurfaceFormat>
+#include "camera_channel.h"
 #include "media_signals.h"
 #include "video_sink.h"
 
@@ -53,39 +55,67 @@ public:
 
     void setCamControl(CameraControl *cc);
     CameraControl *cameraControl() const;
+    // Counts the camera buffers queued for the texture
+    void setCameraChannel(const CameraChannelPtr &channel) { m_cameraChannel = channel; }
 
     void setTextureId(GLuint textureId);
     GLuint textureId() const { return m_textureId; }
+    // True until the sampling parameters of the texture have been set
+    bool isTextureDirty() const { return m_textureDirty; }
+    void setTextureClean() { m_textureDirty = false; }
 
     void setSurfaceTextureClient(SurfaceTextureClientHybris surface_texture_client);
     void setGLVideoSink(VideoSink &sink);
     VideoSink &glVideoSink() const;
 
-    void updateTexture();
+    // Called whenever a newer buffer is queued for the texture, from any
+    // thread, with the number of older frames the sink dropped for it
+    void frameAvailable(int skippedFrames = 0);
+    bool updateTexture();
+    int takeSkippedLatches();
+    int takeSkippedSinkFrames();
 
     GLfloat *textureGLMatrix() {
         return static_cast<GLfloat *>(m_textureMatrix.data());
     }
+    // Changes whenever the texture matrix does, unique across materials
+    int textureMatrixGeneration() const { return m_textureMatrixGeneration; }
 
 private Q_SLOTS:
     void onSetOrientation(const SharedSignal::Orientation& orientation, const QSize &size);
     void onSinkReset();
 
 private:
+    // Bounds the buffers latched in one update when the camera got ahead
+    static const int MaxCameraLatches = 4;
+
     QMatrix4x4 rotateAndFlip(const QMatrix4x4 &m,
                              const SharedSignal::Orientation &orientation);
     void undoAndroidYFlip(QMatrix4x4 &matrix);
+    void updateTextureMatrixGeneration();
     void printGLMaxtrix(GLfloat matrix[]);
     void printMaxtrix(float matrix[]);
 
     QVideoSurfaceFormat m_format;
     CameraControl *m_camControl;
+    CameraChannelPtr m_cameraChannel;
     GLuint m_textureId;
+    bool m_textureDirty;
     QMatrix4x4 m_textureMatrix;
+    QMatrix4x4 m_uploadedTextureMatrix;
+    int m_textureMatrixGeneration;
+    int m_variant;
     SurfaceTextureClientHybris m_surfaceTextureClient;
     QPointer<VideoSink> m_videoSink;
+    QMetaObject::Connection m_videoSinkConnection;
+    QMetaObject::Connection m_videoSinkErrorConnection;
+    // Generations of the newest buffer queued and of the one latched. Camera
+    // buffers are counted by the camera channel instead.
+    QAtomicInt m_availableFrames;
+    qint64 m_latchedFrames;
+    int m_skippedLatches;
+    QAtomicInt m_skippedSinkFrames;
     bool m_readyToRender;
-    static ShaderVideoShader *m_videoShader; // the shader is cached in the Qt scene graph
     SharedSignal::Orientation m_orientation;
     QSize m_frameSize;
 };
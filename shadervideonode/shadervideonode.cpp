@@ -22,13 +22,18 @@
 #include "media_signals.h"
 #include <hybris/media/surface_texture_client_hybris.h>
 
+#include <utility>
+
 /*!
  * \brief ShaderVideoNode::ShaderVideoNode
  * \param format
  */
 ShaderVideoNode::ShaderVideoNode(const QVideoSurfaceFormat &format) :
     m_format(format),
-    m_textureId(0)
+    m_textureId(0),
+    m_cameraControl(0),
+    m_pendingSequence(0),
+    m_pendingPresentTime(0)
 {
     QSGNode::setFlag(UsePreprocess, true);
 
@@ -36,10 +41,6 @@ ShaderVideoNode::ShaderVideoNode(const QVideoSurfaceFormat &format) :
     setMaterial(m_material);
 
     m_snapshotGenerator = new SnapshotGenerator;
-    connect(SharedSignal::instance(), SIGNAL(setSnapshotSize(const QSize&)), this, SLOT(onSetSnapshotSize(const QSize&)));
-    connect(SharedSignal::instance(), SIGNAL(takeSnapshot(const CameraControl*)), this, SLOT(onTakeSnapshot(const CameraControl*)));
-
-    qDebug() << SharedSignal::instance();
 }
 
 /*!
@@ -53,7 +54,27 @@ ShaderVideoNode::~ShaderVideoNode()
 
 void ShaderVideoNode::preprocess()
 {
-    m_material->updateTexture();
+    // Frames rendered for other reasons, like animations above the
+    // viewfinder, leave the texture as it is
+    if (m_material->updateTexture()) {
+        if (m_material->cameraControl()) {
+            const int skipped = m_material->takeSkippedLatches();
+            if (skipped > 0 && m_channel)
+                m_channel->textureLatchesSkipped(skipped);
+        } else {
+            const int skipped = m_material->takeSkippedSinkFrames();
+            if (skipped > 0)
+                Q_EMIT SharedSignal::instance()->sinkFramesSkipped(skipped);
+        }
+    }
+
+    if (m_pendingPresentTime) {
+        if (m_channel)
+            m_channel->frameRendered(m_pendingSequence, CameraChannel::monotonicTime() - m_pendingPresentTime);
+        m_pendingPresentTime = 0;
+    }
+
+    updateSnapshot();
 }
 
 /*!
@@ -81,6 +102,14 @@ void ShaderVideoNode::setCurrentFrame(const QVideoFrame &frame, FrameFlags flags
             return;
         }
         m_material->setCamControl((CameraControl*)ci);
+        m_cameraControl = (CameraControl*)ci;
+        m_channel = frame.metaData("CameraChannel").value<CameraChannelPtr>();
+        m_material->setCameraChannel(m_channel);
+
+        if (frame.availableMetaData().contains("PresentTime")) {
+            m_pendingSequence = frame.metaData("SequenceNumber").toLongLong();
+            m_pendingPresentTime = frame.metaData("PresentTime").toLongLong();
+        }
     } else if (frame.availableMetaData().contains("GLVideoSink")) {
         auto sink = frame.metaData("GLVideoSink").value<VideoSink*>();
         qDebug() << "** Setting GLConsumer instance: " << sink;
@@ -90,6 +119,10 @@ void ShaderVideoNode::setCurrentFrame(const QVideoFrame &frame, FrameFlags flags
             return;
         }
 
+        m_cameraControl = 0;
+        m_channel.reset();
+        m_material->setCameraChannel(m_channel);
+
         // Signal AalMediaPlayerService that glConsumer has been set
         Q_EMIT SharedSignal::instance()->glConsumerSet();
     }
@@ -102,7 +135,10 @@ void ShaderVideoNode::setCurrentFrame(const QVideoFrame &frame, FrameFlags flags
         // Prevent drawing
         m_material->setCamControl(0);
     } else {
-        // Draw the frame
+        // Draw the frame. Camera buffers are counted by the channel, from
+        // the HAL frame callbacks.
+        if (ci && !m_channel)
+            m_material->frameAvailable();
         markDirty(QSGNode::DirtyMaterial);
     }
 }
@@ -117,29 +153,35 @@ QAbstractVideoBuffer::HandleType ShaderVideoNode::handleType() const
 }
 
 /*!
- * \brief ShaderVideoNode::onSetSnapshotSize sets the target size for the snapshot
- * \param size
+ * \brief ShaderVideoNode::updateSnapshot delivers the snapshot whose readback
+ * completed, and starts the one the camera requested from the frame just
+ * updated
+ * Snapshots are read back a frame after being drawn, so that the render
+ * thread never waits for the GPU.
  */
-void ShaderVideoNode::onSetSnapshotSize(const QSize &size)
+void ShaderVideoNode::updateSnapshot()
 {
     Q_ASSERT(m_snapshotGenerator != NULL);
-    m_snapshotGenerator->setSize(size.width(), size.height());
-}
 
-/*!
- * \brief ShaderVideoNode::onTakeSnapshot creates an image of the current frame
- * and sends it back to the client (camera/mediaplayer)
- * \param control
- */
-void ShaderVideoNode::onTakeSnapshot(const CameraControl *control)
-{
-    Q_ASSERT(m_textureId > 0);
-    Q_ASSERT(control != NULL);
-    Q_ASSERT(m_snapshotGenerator != NULL);
-    QImage snapshot = m_snapshotGenerator->snapshot(m_textureId, control);
+    QImage snapshot;
+    if (m_snapshotGenerator->finish(&snapshot) && m_snapshotChannel) {
+        // Hand the snapshot to the QVideoRendererControl instance that asked for it
+        m_snapshotChannel->snapshotTaken(std::move(snapshot));
+        m_snapshotChannel.reset();
+    }
+
+    QSize size;
+    if (!m_channel || m_snapshotGenerator->isPending() || !m_channel->takeSnapshotRequest(&size))
+        return;
 
-    // Signal the QVideoRendererControl instance that a snapshot has been taken
-    Q_EMIT SharedSignal::instance()->snapshotTaken(snapshot);
+    m_snapshotChannel = m_channel;
+    m_snapshotGenerator->setSize(size.width(), size.height());
+    if (!m_textureId || !m_cameraControl ||
+        !m_snapshotGenerator->start(m_textureId, m_cameraControl)) {
+        qWarning() << "Failed to start snapshot";
+        m_snapshotChannel->snapshotTaken(QImage());
+        m_snapshotChannel.reset();
+    }
 }
 
 /*!
@@ -162,7 +204,10 @@ void ShaderVideoNode::getGLTextureID()
     }
 
     m_material->setTextureId(m_textureId);
-    Q_EMIT SharedSignal::instance()->textureCreated(static_cast<unsigned int>(m_textureId));
+    if (m_channel)
+        m_channel->textureCreated(static_cast<unsigned int>(m_textureId));
+    else
+        Q_EMIT SharedSignal::instance()->textureCreated(static_cast<unsigned int>(m_textureId));
 }
 
 /*!
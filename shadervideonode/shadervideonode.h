@@ -18,6 +18,8 @@
 #ifndef SHADERVIDEONODE_H
 #define SHADERVIDEONODE_H
 
+#include "camera_channel.h"
+
 #include <QObject>
 #include <qsgvideonode_p.h>
 
@@ -46,11 +48,8 @@ public:
     void setCurrentFrame(const QVideoFrame &frame, FrameFlags flags);
     QAbstractVideoBuffer::HandleType handleType() const;
 
-private Q_SLOTS:
-    void onSetSnapshotSize(const QSize &size);
-    void onTakeSnapshot(const CameraControl *control);
-
 private:
+    void updateSnapshot();
     void getGLTextureID();
     void deleteTextureID();
 
@@ -59,6 +58,14 @@ private:
     GLuint m_textureId;
     std::shared_ptr<core::ubuntu::media::video::Sink> m_videoSink;
     SnapshotGenerator *m_snapshotGenerator;
+    // Camera of the latest frame, and the channel to its renderer control
+    const CameraControl *m_cameraControl;
+    CameraChannelPtr m_channel;
+    // Channel the snapshot being read back goes to
+    CameraChannelPtr m_snapshotChannel;
+    // Camera frame waiting to be rendered, to report its latency
+    qint64 m_pendingSequence;
+    qint64 m_pendingPresentTime;
 };
 
 Q_DECLARE_METATYPE(std::shared_ptr<core::ubuntu::media::video::Sink>);
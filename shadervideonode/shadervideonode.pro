@@ -26,7 +26,9 @@ HEADERS += \
     video_sink.h \
     video_sink_p.h \
     egl_video_sink.h \
-    media_signals.h
+    camera_channel.h \
+    media_signals.h \
+    shader_program_cache.h
 
 SOURCES += \
     shadervideonodeplugin.cpp \
@@ -16,9 +16,18 @@
 
 #include "shadervideonodeplugin.h"
 #include "shadervideonode.h"
+#include "shadervideoshader.h"
+#include "snapshotgenerator.h"
 
 #include <QtCore/qdebug.h>
 
+ShaderVideoNodePlugin::ShaderVideoNodePlugin()
+{
+    // Get the programs onto the disk cache before the first frame needs them
+    ShaderVideoShader::warmUp();
+    SnapshotGenerator::warmUp();
+}
+
 ShaderVideoNodePlugin::~ShaderVideoNodePlugin()
 {
 }
@@ -16,37 +16,102 @@
 
 #include "shadervideoshader.h"
 #include "shadervideomaterial.h"
+#include "shader_program_cache.h"
 #include <QtGui/QOpenGLFunctions>
 
-ShaderVideoShader::ShaderVideoShader(QVideoFrame::PixelFormat pixelFormat)
+#ifndef GL_TEXTURE_EXTERNAL_OES
+#define GL_TEXTURE_EXTERNAL_OES 0x8D65
+#endif
+
+ShaderVideoShader::ShaderVideoShader(int variant)
     : QSGMaterialShader(),
-      m_pixelFormat(pixelFormat)
+      m_id_matrix(-1),
+      m_id_texture(-1),
+      m_id_opacity(-1),
+      m_tex_matrix(-1),
+      m_variant(variant),
+      m_vertexShader(vertexShaderSource()),
+      m_fragmentShader(fragmentShaderSource(variant)),
+      m_textureMatrixGeneration(0),
+      m_samplerSet(false)
 {
 }
 
+/*!
+ * \brief ShaderVideoShader::variant returns the shader variant drawing frames
+ * of the given pixel format
+ * The texture target is fixed at build time: video textures are external
+ * images on OpenGL ES, plain 2D textures otherwise.
+ */
+int ShaderVideoShader::variant(QVideoFrame::PixelFormat pixelFormat)
+{
+    int variant = 0;
+#if defined(QT_OPENGL_ES_2)
+    variant |= ExternalTexture;
+#endif
+
+    switch (pixelFormat) {
+    case QVideoFrame::Format_BGR32:
+        variant |= IgnoreAlpha;
+        // fall through
+    case QVideoFrame::Format_BGRA32:
+        // External images are sampled as RGB whatever their layout
+        if (!(variant & ExternalTexture))
+            variant |= SwapRedBlue;
+        break;
+    case QVideoFrame::Format_ARGB32:
+        break;
+    default:
+        // RGB32, and the camera textures handed over as Format_User
+        variant |= IgnoreAlpha;
+        break;
+    }
+
+    return variant;
+}
+
+GLenum ShaderVideoShader::textureTarget(int variant)
+{
+    return (variant & ExternalTexture) ? GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+}
+
 void ShaderVideoShader::updateState(const RenderState &state,
                                                 QSGMaterial *newMaterial,
                                                 QSGMaterial *oldMaterial)
 {
-    Q_UNUSED(oldMaterial);
-    ShaderVideoMaterial *mat = dynamic_cast<ShaderVideoMaterial *>(newMaterial);
+    // Each variant has its own material type, so the material is ours
+    ShaderVideoMaterial *mat = static_cast<ShaderVideoMaterial *>(newMaterial);
     QOpenGLFunctions *functions = QOpenGLContext::currentContext()->functions();
+    const GLenum target = textureTarget(m_variant);
 
-#if !defined(QT_OPENGL_ES_2)
-    const GLenum textureTarget = GL_TEXTURE_2D;
-#else
-    const GLenum textureTarget = GL_TEXTURE_EXTERNAL_OES;
-#endif
-    functions->glBindTexture(textureTarget, mat->textureId());
-    functions->glTexParameteri(textureTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    functions->glTexParameteri(textureTarget, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    functions->glTexParameteri(textureTarget, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    functions->glTexParameteri(textureTarget, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // Other shaders may have bound their own textures since the last draw
+    // of this material
+    if (newMaterial != oldMaterial || mat->isTextureDirty())
+        functions->glBindTexture(target, mat->textureId());
 
-    program()->setUniformValue(m_id_texture, 0);
+    // Sampling parameters belong to the texture, set them once per texture
+    if (mat->isTextureDirty()) {
+        functions->glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        functions->glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        functions->glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        functions->glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        mat->setTextureClean();
+    }
 
-    functions->glUniformMatrix4fv(m_tex_matrix, 1, GL_FALSE, mat->textureGLMatrix());
+    if (!m_samplerSet) {
+        program()->setUniformValue(m_id_texture, 0);
+        m_samplerSet = true;
+    }
 
+    // Matrix generations are unique across materials, so a match means the
+    // program already holds this very matrix
+    if (mat->textureMatrixGeneration() != m_textureMatrixGeneration) {
+        functions->glUniformMatrix4fv(m_tex_matrix, 1, GL_FALSE, mat->textureGLMatrix());
+        m_textureMatrixGeneration = mat->textureMatrixGeneration();
+    }
+
+    // The opacity only becomes known while rendering, it cannot select the
+    // program without drawing the first frame of a fade with the old one
     if (state.isOpacityDirty())
         program()->setUniformValue(m_id_opacity, state.opacity());
 
@@ -64,9 +129,50 @@ char const *const *ShaderVideoShader::attributeNames() const
     return names;
 }
 
+/*!
+ * \brief ShaderVideoShader::warmUp builds the video programs of this build
+ * in the background
+ * The scene graph links them from the program binary cache afterwards,
+ * provided that sources and attribute locations are the same.
+ */
+void ShaderVideoShader::warmUp()
+{
+    ShaderProgramCache::AttributeLocations attributes;
+    const char *const *names = ShaderVideoShader(0).attributeNames();
+    for (int i = 0; names[i]; i++)
+        attributes.append(qMakePair(QByteArray(names[i]), i));
+
+    static const QVideoFrame::PixelFormat formats[] = {
+        QVideoFrame::Format_RGB32,
+        QVideoFrame::Format_ARGB32,
+        QVideoFrame::Format_BGR32,
+        QVideoFrame::Format_BGRA32
+    };
+
+    QList<int> variants;
+    for (QVideoFrame::PixelFormat format : formats) {
+        const int v = variant(format);
+        if (!variants.contains(v))
+            variants.append(v);
+    }
+
+    for (int v : variants)
+        ShaderProgramCache::instance()->warmUp(vertexShaderSource(), fragmentShaderSource(v), attributes);
+}
+
 const char *ShaderVideoShader::vertexShader() const
 {
-    const char *shader =
+    return m_vertexShader.constData();
+}
+
+const char *ShaderVideoShader::fragmentShader() const
+{
+    return m_fragmentShader.constData();
+}
+
+QByteArray ShaderVideoShader::vertexShaderSource()
+{
+    return
         "uniform highp mat4 qt_Matrix;                      \n"
         "attribute highp vec4 qt_VertexPosition;            \n"
         "attribute highp vec2 qt_VertexTexCoord;            \n"
@@ -76,14 +182,17 @@ const char *ShaderVideoShader::vertexShader() const
         "    qt_TexCoord = (s_tex_Matrix * vec4(qt_VertexTexCoord, 0.0, 1.0)).xy;\n"
         "    gl_Position = qt_Matrix * qt_VertexPosition;   \n"
         "}";
-    return shader;
 }
 
-const char *ShaderVideoShader::fragmentShader() const
+/*!
+ * \brief ShaderVideoShader::fragmentShaderSource returns the fragment shader
+ * of a variant, specialised with preprocessor definitions
+ */
+QByteArray ShaderVideoShader::fragmentShaderSource(int variant)
 {
     static const char *shader =
-        "#extension GL_OES_EGL_image_external : enable       \n"
-        "#ifdef GL_OES_EGL_image_external                    \n"
+        "#ifdef EXTERNAL_TEXTURE                             \n"
+        "#extension GL_OES_EGL_image_external : require      \n"
         "uniform samplerExternalOES sTexture;                \n"
         "#else                                               \n"
         "uniform sampler2D sTexture;                         \n"
@@ -92,9 +201,24 @@ const char *ShaderVideoShader::fragmentShader() const
         "varying highp vec2 qt_TexCoord;                     \n"
         "void main()                                         \n"
         "{                                                   \n"
-        "  gl_FragColor = texture2D( sTexture, qt_TexCoord ) * vec4(opacity);\n"
+        "  lowp vec4 color = texture2D( sTexture, qt_TexCoord );\n"
+        "#ifdef SWAP_RED_BLUE                                \n"
+        "  color = color.bgra;                               \n"
+        "#endif                                              \n"
+        "#ifdef IGNORE_ALPHA                                 \n"
+        "  color.a = 1.0;                                    \n"
+        "#endif                                              \n"
+        "  gl_FragColor = color * vec4(opacity);             \n"
         "}                                                   \n";
-    return shader;
+
+    QByteArray source;
+    if (variant & ExternalTexture)
+        source += "#define EXTERNAL_TEXTURE\n";
+    if (variant & IgnoreAlpha)
+        source += "#define IGNORE_ALPHA\n";
+    if (variant & SwapRedBlue)
+        source += "#define SWAP_RED_BLUE\n";
+    return source + shader;
 }
 
 void ShaderVideoShader::initialize()
@@ -103,4 +227,7 @@ void ShaderVideoShader::initialize()
     m_id_texture = program()->uniformLocation("sTexture");
     m_id_opacity = program()->uniformLocation("opacity");
     m_tex_matrix = program()->uniformLocation("s_tex_Matrix");
+    // A new program holds none of the values set to the previous one
+    m_textureMatrixGeneration = 0;
+    m_samplerSet = false;
 }
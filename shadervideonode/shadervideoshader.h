@@ -23,18 +23,37 @@
 #else
 #include <QtQuick/QSGMaterialShader>
 #endif
+#include <QByteArray>
 #include <QVideoFrame>
+#include <qopengl.h>
 
+/*!
+ * \brief The ShaderVideoShader class draws video textures, with a program
+ * specialised for the texture target and pixel format of the material
+ * variant it was created for
+ * GL state is only sent when it differs from what the program or texture
+ * already hold, so that a frame of an unchanged video costs a single draw.
+ */
 class ShaderVideoShader : public QSGMaterialShader
 {
 public:
-    ShaderVideoShader(QVideoFrame::PixelFormat pixelFormat);
+    enum VariantFlag {
+        ExternalTexture = 0x1, // samplerExternalOES instead of sampler2D
+        IgnoreAlpha = 0x2,     // formats without alpha, drawn opaque
+        SwapRedBlue = 0x4      // BGR formats in a 2D texture
+    };
+    static const int VariantCount = 8;
+
+    explicit ShaderVideoShader(int variant);
+
+    static int variant(QVideoFrame::PixelFormat pixelFormat);
+    static GLenum textureTarget(int variant);
 
     void updateState(const RenderState &state, QSGMaterial *newMaterial, QSGMaterial *oldMaterial);
 
     char const *const *attributeNames() const;
 
-    int m_tex_matrix;
+    static void warmUp();
 
 protected:
     const char *vertexShader() const;
@@ -42,10 +61,19 @@ protected:
 
     void initialize();
 
+    static QByteArray vertexShaderSource();
+    static QByteArray fragmentShaderSource(int variant);
+
     int m_id_matrix;
     int m_id_texture;
     int m_id_opacity;
-    QVideoFrame::PixelFormat m_pixelFormat;
+    int m_tex_matrix;
+    int m_variant;
+    QByteArray m_vertexShader;
+    QByteArray m_fragmentShader;
+    // Texture matrix the program holds, and whether the sampler is set
+    int m_textureMatrixGeneration;
+    bool m_samplerSet;
 };
 
 #endif // SHADERVIDEOSHADER_H
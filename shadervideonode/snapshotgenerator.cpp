@@ -16,16 +16,51 @@
  */
 
 #include "snapshotgenerator.h"
+#include "shader_program_cache.h"
 
 #include <hybris/camera/camera_compatibility_layer.h>
 
-#include <QOpenGLFramebufferObject>
-#include <QOpenGLPaintDevice>
+#include <QDebug>
+#include <QMatrix4x4>
+#include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
-#include <QOpenGLShader>
-#include <QPainter>
 
-#include <cstdio>
+#include <cstring>
+
+#ifndef GL_TEXTURE_EXTERNAL_OES
+#define GL_TEXTURE_EXTERNAL_OES 0x8D65
+#endif
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+
+#ifndef GL_ALREADY_SIGNALED
+#define GL_ALREADY_SIGNALED 0x911A
+#endif
+
+#ifndef GL_CONDITION_SATISFIED
+#define GL_CONDITION_SATISFIED 0x911C
+#endif
+
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+
+// Longest wait for a readback that is overdue, in nanoseconds
+static const GLuint64 OVERDUE_READBACK_TIMEOUT = 100000000;
 
 SnapshotGenerator::SnapshotGenerator()
     : m_width(0),
@@ -34,45 +69,217 @@ SnapshotGenerator::SnapshotGenerator()
       v_matrix_loc(0),
       tex_coord_loc(0),
       sampler_loc(0),
-      tex_matrix_loc(0)
+      tex_matrix_loc(0),
+      m_extra(nullptr),
+      m_fbo(0),
+      m_texture(0),
+      m_pbo(0),
+      m_fence(0),
+      m_pending(false),
+      m_pendingFrames(0)
 {
 }
 
+SnapshotGenerator::~SnapshotGenerator()
+{
+    // GL objects can only be released with their context current,
+    // otherwise they go away together with the context itself
+    if (m_context && m_context == QOpenGLContext::currentContext())
+        release();
+}
+
 /**
- * @brief SnapshotGenerator::snapshot
+ * @brief SnapshotGenerator::start draws the texture into the snapshot
+ * framebuffer and starts reading it back
  * @param textureId Texture to be stored as QImage
- * @return Image containing the content of the last texture
+ * @return false if the snapshot could not be started
  */
-QImage SnapshotGenerator::snapshot(GLuint textureId, const CameraControl *control)
+bool SnapshotGenerator::start(GLuint textureId, const CameraControl *control)
 {
     Q_ASSERT(textureId > 0);
     Q_ASSERT(control != NULL);
 
-    QOpenGLFramebufferObject fbo(m_width, m_height);
-    fbo.bind();
-    QOpenGLPaintDevice paintDevice(m_width, m_height);
-    QPainter paint(&paintDevice);
+    if (m_pending || m_width <= 0 || m_height <= 0)
+        return false;
+
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context || !prepare(context))
+        return false;
+
+    QOpenGLFunctions *gl = context->functions();
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    draw(textureId, control);
+
+    if (m_pbo) {
+        // The copy into the pixel buffer runs asynchronously, the fence tells
+        // when it is over
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo);
+        gl->glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        m_fence = m_extra->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    gl->glFlush();
+
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, context->defaultFramebufferObject());
+
+    m_pending = true;
+    m_pendingFrames = 0;
+    return true;
+}
+
+/**
+ * @brief SnapshotGenerator::finish collects the image of the snapshot started
+ * last, without waiting for the GPU unless the readback is overdue
+ * @return true if the image is ready
+ */
+bool SnapshotGenerator::finish(QImage *image)
+{
+    if (!m_pending)
+        return false;
+
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context || context != m_context) {
+        // The context went away with the framebuffer, give up on the snapshot
+        m_pending = false;
+        *image = QImage();
+        return true;
+    }
+
+    if (m_fence) {
+        const bool overdue = ++m_pendingFrames >= MaxPendingFrames;
+        const GLenum status = m_extra->glClientWaitSync(m_fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                                        overdue ? OVERDUE_READBACK_TIMEOUT : 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED && !overdue)
+            return false;
+
+        m_extra->glDeleteSync(m_fence);
+        m_fence = 0;
+    }
+
+    // Rows are drawn top down, so the image needs no flipping
+    QImage result(m_width, m_height, QImage::Format_RGBA8888);
+    readPixels(result.bits());
+
+    m_pending = false;
+    *image = result;
+    return true;
+}
+
+void SnapshotGenerator::setSize(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+}
+
+/*!
+ * \brief SnapshotGenerator::prepare creates the framebuffer, pixel buffer
+ * and program of the snapshots, unless the current ones can be reused
+ */
+bool SnapshotGenerator::prepare(QOpenGLContext *context)
+{
+    if (context != m_context) {
+        release();
+        m_context = context;
+        // Pixel pack buffers and fences need OpenGL ES 3.0
+        m_extra = context->format().majorVersion() >= 3 ? context->extraFunctions() : nullptr;
+    }
+
+    if (!m_program) {
+        m_program = ShaderProgramCache::instance()->program(vertexShader(), fragmentShader());
+        if (!m_program)
+            return false;
+
+        position_loc = m_program->attributeLocation("a_position");
+        v_matrix_loc = m_program->uniformLocation("v_matrix");
+        sampler_loc = m_program->uniformLocation("s_texture");
+        tex_coord_loc = m_program->attributeLocation("a_texCoord");
+        tex_matrix_loc = m_program->uniformLocation("m_texMatrix");
+    }
 
-#ifdef __arm__
-    QOpenGLShaderProgram program;
-    program.addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShader());
-    program.addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShader());
+    const QSize size(m_width, m_height);
+    if (m_fbo && m_targetSize == size)
+        return true;
 
-    program.link();
-    program.bind();
+    QOpenGLFunctions *gl = context->functions();
+    if (!m_fbo) {
+        gl->glGenFramebuffers(1, &m_fbo);
+        gl->glGenTextures(1, &m_texture);
+    }
 
-    glViewport(0, 0, m_width, m_height);
+    gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_width, m_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->glBindTexture(GL_TEXTURE_2D, 0);
 
-    position_loc = program.attributeLocation("a_position");
-    v_matrix_loc = program.uniformLocation("v_matrix");
-    sampler_loc = program.uniformLocation("s_texture");
-    tex_coord_loc = program.attributeLocation("a_texCoord");
-    tex_matrix_loc = program.uniformLocation("m_texMatrix");
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, 0);
+    const GLenum status = gl->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, context->defaultFramebufferObject());
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        qWarning() << "Snapshot framebuffer is incomplete:" << status;
+        release();
+        return false;
+    }
 
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (m_extra) {
+        if (!m_pbo)
+            m_extra->glGenBuffers(1, &m_pbo);
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo);
+        m_extra->glBufferData(GL_PIXEL_PACK_BUFFER, m_width * m_height * 4, nullptr, GL_STREAM_READ);
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    m_targetSize = size;
+    return true;
+}
+
+void SnapshotGenerator::release()
+{
+    if (m_context && m_context == QOpenGLContext::currentContext()) {
+        QOpenGLFunctions *gl = m_context->functions();
+        if (m_fence)
+            m_extra->glDeleteSync(m_fence);
+        if (m_pbo)
+            gl->glDeleteBuffers(1, &m_pbo);
+        if (m_fbo)
+            gl->glDeleteFramebuffers(1, &m_fbo);
+        if (m_texture)
+            gl->glDeleteTextures(1, &m_texture);
+    }
+
+    m_program.reset();
+    m_fence = 0;
+    m_pbo = 0;
+    m_fbo = 0;
+    m_texture = 0;
+    m_targetSize = QSize();
+    m_pending = false;
+    m_context = nullptr;
+    m_extra = nullptr;
+}
+
+void SnapshotGenerator::draw(GLuint textureId, const CameraControl *control)
+{
+    QOpenGLFunctions *gl = m_context->functions();
+
+#if !defined(QT_OPENGL_ES_2)
+    const GLenum textureTarget = GL_TEXTURE_2D;
+#else
+    const GLenum textureTarget = GL_TEXTURE_EXTERNAL_OES;
+#endif
+
+    m_program->bind();
+
+    gl->glViewport(0, 0, m_width, m_height);
+
+    // The camera texture is sampled from unit 0
+    gl->glActiveTexture(GL_TEXTURE0);
+    gl->glBindTexture(textureTarget, textureId);
+    gl->glTexParameteri(textureTarget, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl->glTexParameteri(textureTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->glTexParameteri(textureTarget, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(textureTarget, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
     GLfloat vVertices[] = {
         0.0f, 00.0f, 0.0f, // Position 0
@@ -94,44 +301,74 @@ QImage SnapshotGenerator::snapshot(GLuint textureId, const CameraControl *contro
 
     GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
 
-    program.enableAttributeArray(position_loc);
-    program.setAttributeArray(position_loc, vVertices, 3);
+    m_program->enableAttributeArray(position_loc);
+    m_program->setAttributeArray(position_loc, vVertices, 3);
+    // Top row at the bottom of the framebuffer, so that glReadPixels()
+    // returns the rows in image order
     QMatrix4x4 pmvMatrix;
-    pmvMatrix.ortho(QRect(0,0,m_width,m_height));
-    program.setUniformValue(v_matrix_loc, pmvMatrix);
+    pmvMatrix.ortho(0, m_width, 0, m_height, -1, 1);
+    m_program->setUniformValue(v_matrix_loc, pmvMatrix);
 
-    program.enableAttributeArray(tex_coord_loc);
-    program.setAttributeArray(tex_coord_loc, tVertices, 2);
+    m_program->enableAttributeArray(tex_coord_loc);
+    m_program->setAttributeArray(tex_coord_loc, tVertices, 2);
 
-    program.enableAttributeArray(sampler_loc);
-    program.setUniformValue(sampler_loc, 0);
-    program.enableAttributeArray(tex_matrix_loc);
+    m_program->setUniformValue(sampler_loc, 0);
 
     GLfloat textureMatrix[16];
     android_camera_get_preview_texture_transformation(const_cast<CameraControl*>(control), textureMatrix);
     QMatrix4x4 texMat(textureMatrix);
     texMat = texMat.transposed();
-    program.setUniformValue(tex_matrix_loc, texMat);
+    m_program->setUniformValue(tex_matrix_loc, texMat);
 
-    glBindTexture(GL_TEXTURE_2D, textureId);
-    glActiveTexture(GL_TEXTURE0);
+    gl->glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
-#endif
+    m_program->disableAttributeArray(position_loc);
+    m_program->disableAttributeArray(tex_coord_loc);
+    m_program->release();
+    gl->glBindTexture(textureTarget, 0);
+}
 
-    return fbo.toImage();
+/*!
+ * \brief SnapshotGenerator::readPixels copies the snapshot into memory, from
+ * the pixel buffer the readback went to if there is one
+ */
+void SnapshotGenerator::readPixels(uchar *bits)
+{
+    QOpenGLFunctions *gl = m_context->functions();
+    const int numBytes = m_width * m_height * 4;
+
+    if (m_pbo) {
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo);
+        void *data = m_extra->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, numBytes, GL_MAP_READ_BIT);
+        if (data) {
+            memcpy(bits, data, numBytes);
+            m_extra->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            qWarning() << "Failed to map snapshot pixel buffer";
+        }
+        m_extra->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return;
+    }
+
+    // Without pixel buffers the read blocks, but the GPU had a frame to
+    // finish drawing the snapshot
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    gl->glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, bits);
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, m_context->defaultFramebufferObject());
 }
 
-void SnapshotGenerator::setSize(int width, int height)
+/*!
+ * \brief SnapshotGenerator::warmUp builds the snapshot program in the
+ * background, so that taking the first snapshot does not compile it
+ */
+void SnapshotGenerator::warmUp()
 {
-    m_width = width;
-    m_height = height;
+    ShaderProgramCache::instance()->warmUp(vertexShader(), fragmentShader());
 }
 
-const char *SnapshotGenerator::vertexShader() const
+const char *SnapshotGenerator::vertexShader()
 {
     return
-        "#extension GL_OES_EGL_image_external : require              \n"
         "attribute vec4 a_position;                                  \n"
         "uniform highp mat4 v_matrix;                                \n"
         "attribute vec2 a_texCoord;                                  \n"
@@ -144,13 +381,16 @@ const char *SnapshotGenerator::vertexShader() const
         "}                                                           \n";
 }
 
-const char *SnapshotGenerator::fragmentShader() const
+const char *SnapshotGenerator::fragmentShader()
 {
     return
-        "#extension GL_OES_EGL_image_external : require      \n"
-        "precision mediump float;                            \n"
-        "varying vec2 v_texCoord;                            \n"
+        "#extension GL_OES_EGL_image_external : enable       \n"
+        "#ifdef GL_OES_EGL_image_external                    \n"
         "uniform samplerExternalOES s_texture;               \n"
+        "#else                                               \n"
+        "uniform sampler2D s_texture;                        \n"
+        "#endif                                              \n"
+        "varying mediump vec2 v_texCoord;                    \n"
         "void main()                                         \n"
         "{                                                   \n"
         "    gl_FragColor = texture2D( s_texture, v_texCoord );\n"
@@ -19,25 +19,50 @@
 #define SNAPSHOTGENERATOR_H
 
 #include <QImage>
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QPointer>
+#include <QSize>
 
 #include <qopengl.h>
 
+#include <memory>
+
 class CameraControl;
+class QOpenGLShaderProgram;
 
+/*!
+ * \brief The SnapshotGenerator class renders the camera texture into an image
+ * without stalling the render thread
+ * start() draws the texture and starts reading it back, finish() collects
+ * the image on a later frame, once the GPU is done with it. The framebuffer,
+ * program and pixel buffer are kept across snapshots.
+ */
 class SnapshotGenerator
 {
 public:
     SnapshotGenerator();
+    ~SnapshotGenerator();
 
-    QImage snapshot(GLuint textureId, const CameraControl *control);
+    bool start(GLuint textureId, const CameraControl *control);
+    bool finish(QImage *image);
+    bool isPending() const { return m_pending; }
 
     void setSize(int width, int height);
 
+    static void warmUp();
+
 private:
-    const char *vertexShader() const;
-    const char *fragmentShader() const;
-    GLuint loadShader(GLenum shaderType, const char* pSource);
-    GLuint createProgram(const char* pVertexSource, const char* pFragmentSource);
+    // Frames a readback may stay in flight before finish() waits for it
+    static const int MaxPendingFrames = 3;
+
+    static const char *vertexShader();
+    static const char *fragmentShader();
+
+    bool prepare(QOpenGLContext *context);
+    void release();
+    void draw(GLuint textureId, const CameraControl *control);
+    void readPixels(uchar *bits);
 
     int m_width;
     int m_height;
@@ -48,7 +73,16 @@ private:
     GLint sampler_loc;
     GLint tex_matrix_loc;
 
-    QImage m_snapshotImage;
+    QPointer<QOpenGLContext> m_context;
+    QOpenGLExtraFunctions *m_extra;
+    std::shared_ptr<QOpenGLShaderProgram> m_program;
+    GLuint m_fbo;
+    GLuint m_texture;
+    GLuint m_pbo;
+    QSize m_targetSize;
+    GLsync m_fence;
+    bool m_pending;
+    int m_pendingFrames;
 };
 
 #endif // SNAPSHOTGENERATOR_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2013-2014 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "camera_channel.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include <atomic>
+#include <time.h>
+#include <utility>
+
+CameraChannel::CameraChannel(Receiver *receiver)
+    : m_receiver(receiver),
+      m_deliveries(0),
+      m_snapshotRequested(0),
+      m_frameClockVersion(0),
+      m_frameSequence(0),
+      m_frameTime(0)
+{
+}
+
+void CameraChannel::detach()
+{
+    // Both sides use ordered read-modify-writes, so that either a sender
+    // sees the receiver cleared, or detach() sees the sender counted
+    m_receiver.fetchAndStoreOrdered(0);
+    while (m_deliveries.fetchAndAddOrdered(0) != 0)
+        QThread::yieldCurrentThread();
+}
+
+void CameraChannel::requestSnapshot(const QSize &size)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_snapshotSize = size;
+    }
+    m_snapshotRequested.storeRelease(1);
+}
+
+bool CameraChannel::takeSnapshotRequest(QSize *size)
+{
+    // A single atomic load on frames without a request
+    if (!m_snapshotRequested.loadAcquire() || !m_snapshotRequested.testAndSetOrdered(1, 0))
+        return false;
+
+    QMutexLocker locker(&m_mutex);
+    *size = m_snapshotSize;
+    return true;
+}
+
+void CameraChannel::frameArrived()
+{
+    // Frame callbacks all come from the same HAL thread, the only writer
+    const quint64 version = m_frameClockVersion.load();
+    m_frameClockVersion.store(version + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_frameSequence.store(m_frameSequence.load() + 1);
+    m_frameTime.store(monotonicTime());
+    m_frameClockVersion.storeRelease(version + 2);
+}
+
+qint64 CameraChannel::frameClock(qint64 *time) const
+{
+    quint64 version;
+    qint64 sequence;
+    do {
+        version = m_frameClockVersion.loadAcquire();
+        sequence = m_frameSequence.load();
+        *time = m_frameTime.load();
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((version & 1) || m_frameClockVersion.load() != version);
+    return sequence;
+}
+
+qint64 CameraChannel::frameSequence() const
+{
+    return m_frameSequence.loadAcquire();
+}
+
+qint64 CameraChannel::monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void CameraChannel::textureCreated(unsigned int textureId)
+{
+    m_deliveries.fetchAndAddOrdered(1);
+    if (Receiver *receiver = m_receiver.fetchAndAddOrdered(0))
+        receiver->textureCreated(textureId);
+    m_deliveries.fetchAndAddOrdered(-1);
+}
+
+void CameraChannel::snapshotTaken(QImage image)
+{
+    m_deliveries.fetchAndAddOrdered(1);
+    if (Receiver *receiver = m_receiver.fetchAndAddOrdered(0))
+        receiver->snapshotTaken(std::move(image));
+    m_deliveries.fetchAndAddOrdered(-1);
+}
+
+void CameraChannel::frameRendered(qint64 sequence, qint64 latency)
+{
+    m_deliveries.fetchAndAddOrdered(1);
+    if (Receiver *receiver = m_receiver.fetchAndAddOrdered(0))
+        receiver->frameRendered(sequence, latency);
+    m_deliveries.fetchAndAddOrdered(-1);
+}
+
+void CameraChannel::textureLatchesSkipped(int count)
+{
+    m_deliveries.fetchAndAddOrdered(1);
+    if (Receiver *receiver = m_receiver.fetchAndAddOrdered(0))
+        receiver->textureLatchesSkipped(count);
+    m_deliveries.fetchAndAddOrdered(-1);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2013-2014 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAMERA_CHANNEL_H
+#define CAMERA_CHANNEL_H
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QImage>
+#include <QMetaType>
+#include <QMutex>
+#include <QSize>
+
+#include <memory>
+
+/** Connects the camera plugin's renderer control of one camera to the video
+ *  node drawing its viewfinder.
+ *
+ *  The renderer control creates the channel and hands it to the video node
+ *  in the metadata of every viewfinder frame, so that events reach the right
+ *  camera without looking it up, and without going through SharedSignal.
+ *
+ *  Events are delivered on the thread sending them. Receivers queue the ones
+ *  they cannot handle from the render thread to their own thread.
+ */
+class CameraChannel
+{
+public:
+    /** Implemented by the camera side of the channel. Called on the render
+     *  thread, never after the channel is detached from it.
+     */
+    class Receiver
+    {
+    public:
+        virtual ~Receiver() {}
+
+        virtual void textureCreated(unsigned int textureId) = 0;
+        virtual void snapshotTaken(QImage image) = 0;
+        /** Called once the frame is latched into the texture, with the
+         *  render thread's GL context current.
+         */
+        virtual void frameRendered(qint64 sequence, qint64 latency) = 0;
+        virtual void textureLatchesSkipped(int count) = 0;
+    };
+
+    explicit CameraChannel(Receiver *receiver);
+
+    /** Called by the receiver before it goes away. Waits for the events
+     *  being delivered to it, and drops the later ones.
+     */
+    void detach();
+
+    /** Asks the video node for an image of the next rendered frame, scaled
+     *  to the given size.
+     */
+    void requestSnapshot(const QSize &size);
+    /** Called by the video node on every frame. Returns true, and the size of
+     *  the snapshot, once after it has been requested.
+     */
+    bool takeSnapshotRequest(QSize *size);
+
+    /** Called on the HAL thread for every viewfinder frame callback. Counts
+     *  the frame and timestamps it, without taking a lock.
+     */
+    void frameArrived();
+    /** Returns the sequence number of the latest frame callback, and its
+     *  time in *time. Can be called from any thread.
+     */
+    qint64 frameClock(qint64 *time) const;
+    /** Returns the number of frame callbacks so far, each of which queued a
+     *  buffer for the viewfinder texture.
+     */
+    qint64 frameSequence() const;
+
+    /** Returns the time of the monotonic clock in microseconds, the clock
+     *  camera frames are timestamped with on both sides of the channel.
+     */
+    static qint64 monotonicTime();
+
+    void textureCreated(unsigned int textureId);
+    void snapshotTaken(QImage image);
+    void frameRendered(qint64 sequence, qint64 latency);
+    void textureLatchesSkipped(int count);
+
+private:
+    Q_DISABLE_COPY(CameraChannel)
+
+    // Events are sent for every frame, without a lock: senders count
+    // themselves in m_deliveries while they use the receiver, and detach()
+    // waits for the count to drop to zero once the receiver is cleared
+    QAtomicPointer<Receiver> m_receiver;
+    QAtomicInt m_deliveries;
+
+    // Guards the snapshot size, only used when a snapshot is requested
+    QMutex m_mutex;
+    QAtomicInt m_snapshotRequested;
+    QSize m_snapshotSize;
+
+    // Sequence lock over the frame clock: odd while frameArrived() updates
+    // it, so that readers retry instead of seeing a torn pair
+    QAtomicInteger<quint64> m_frameClockVersion;
+    QAtomicInteger<qint64> m_frameSequence;
+    QAtomicInteger<qint64> m_frameTime;
+};
+
+typedef std::shared_ptr<CameraChannel> CameraChannelPtr;
+
+Q_DECLARE_METATYPE(CameraChannelPtr)
+
+#endif // CAMERA_CHANNEL_H
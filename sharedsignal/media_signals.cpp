@@ -16,11 +16,6 @@
 
 #include "media_signals.h"
 
-#include <QMutexLocker>
-
-SharedSignal *SharedSignal::m_sharedSignal = NULL;
-QMutex SharedSignal::m_mutex;
-
 SharedSignal::SharedSignal(QObject *parent)
     : QObject(parent)
 {
@@ -29,9 +24,7 @@ SharedSignal::SharedSignal(QObject *parent)
 
 SharedSignal* SharedSignal::instance()
 {
-    QMutexLocker locker(&m_mutex);
-    if (m_sharedSignal == NULL)
-        m_sharedSignal = new SharedSignal();
-
-    return m_sharedSignal;
+    // Created once in a thread-safe way, and looked up without locking
+    static SharedSignal *sharedSignal = new SharedSignal();
+    return sharedSignal;
 }
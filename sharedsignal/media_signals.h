@@ -18,7 +18,6 @@
 #define MEDIA_SIGNALS_H
 
 #include <QImage>
-#include <QMutex>
 #include <QObject>
 #include <QSize>
 
@@ -49,13 +48,30 @@ Q_SIGNALS:
      */
     void sinkReset();
     /** Thrown by qtvideo-node to signal when the GL texture has
-     * been successfully created.
+     * been successfully created. Camera textures are reported through the
+     * camera's CameraChannel instead.
      */
     void textureCreated(unsigned int textureID);
     /** Thrown by qtvideo-node to signal when the GLConsumer instance
      * has been successfully passed to it and set.
      */
     void glConsumerSet();
+    /** Thrown by qtvideo-node when the video sink it draws from cannot get
+     * frames from its source. May be thrown from any thread.
+     * @param message description of the error
+     */
+    void sinkError(const QString &message);
+    /** Thrown by qtvideo-node when it latches a video sink frame, if the sink
+     * dropped older frames that arrived along with it.
+     * @param count number of frames dropped since the previous latch
+     */
+    void sinkFramesSkipped(int count);
+    /** Thrown by AalMediaPlayerService to make the video sinks latch only
+     * the newest of the frames queued since the previous latch, dropping the
+     * older ones, instead of latching all of them in order.
+     * @param newest true to latch the newest frame only
+     */
+    void setSinkLatchNewest(bool newest);
     /** Thrown by AalMediaPlayerService to indicate to qtvideo-node
      * which rotation transformation matrix needs to be applied to
      * each video frame for rendering.
@@ -63,15 +79,17 @@ Q_SIGNALS:
      * @param size width/height of a video frame
      */
     void setOrientation(const SharedSignal::Orientation& orientation, const QSize &size);
-    /** Thrown by AalVideoRendererControl to signal set the snapshot size.
+    /** Formerly thrown by AalVideoRendererControl to signal set the
+     * snapshot size. Snapshots are now requested through CameraChannel.
      */
     void setSnapshotSize(const QSize &size);
-    /** Thrown by ShaderVideoNode when the snapshot image has been successfully
-     * taken and stored in memory.
+    /** Formerly thrown by ShaderVideoNode when the snapshot image has been
+     * successfully taken and stored in memory. Now sent through CameraChannel.
      */
     void snapshotTaken(QImage snapshotImage);
-    /** Thrown by AalVideoRendererControl to signal when to capture
-     * a still image from the preview video stream.
+    /** Formerly thrown by AalVideoRendererControl to signal when to capture
+     * a still image from the preview video stream. Now sent through
+     * CameraChannel.
      */
     void takeSnapshot(const CameraControl *control);
 
@@ -80,9 +98,6 @@ protected:
 
 private:
     Q_DISABLE_COPY(SharedSignal);
-
-    static SharedSignal *m_sharedSignal;
-    static QMutex m_mutex;
 };
 
 #endif // SHAREDSIGNAL_H
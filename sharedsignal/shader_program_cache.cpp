@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2013-2014 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shader_program_cache.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QGuiApplication>
+#include <QMutexLocker>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QThread>
+
+/** Builds queued shader sources in a context of its own. The programs are
+ *  thrown away, what matters is their binary landing in the disk cache, so
+ *  the context shares nothing with the scene graph ones.
+ */
+class ShaderWarmUpThread : public QThread
+{
+public:
+    struct Sources {
+        QByteArray vertexShader;
+        QByteArray fragmentShader;
+        ShaderProgramCache::AttributeLocations attributes;
+    };
+
+    ShaderWarmUpThread()
+        : m_surface(new QOffscreenSurface),
+          m_exiting(false)
+    {
+        // Offscreen surfaces have to be created on the GUI thread
+        m_surface->create();
+    }
+
+    ~ShaderWarmUpThread()
+    {
+        wait();
+        delete m_surface;
+    }
+
+    /** Returns false once the thread has decided to exit, in which case the
+     *  sources have to go to a new thread.
+     */
+    bool enqueue(const Sources &sources)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_exiting)
+            return false;
+        m_queue.append(sources);
+        return true;
+    }
+
+protected:
+    void run()
+    {
+        QOpenGLContext context;
+        context.setFormat(m_surface->format());
+        if (!context.create() || !context.makeCurrent(m_surface)) {
+            qWarning() << "Failed to create OpenGL context, shaders will not be warmed up";
+            QMutexLocker locker(&m_mutex);
+            m_exiting = true;
+            m_queue.clear();
+            return;
+        }
+
+        Q_FOREVER {
+            Sources sources;
+            {
+                // Decided under the lock, so that no source is queued after
+                // the queue was found empty
+                QMutexLocker locker(&m_mutex);
+                if (m_queue.isEmpty()) {
+                    m_exiting = true;
+                    break;
+                }
+                sources = m_queue.takeFirst();
+            }
+            ShaderProgramCache::build(sources.vertexShader, sources.fragmentShader, sources.attributes);
+        }
+
+        context.doneCurrent();
+    }
+
+private:
+    QOffscreenSurface *m_surface;
+    QMutex m_mutex;
+    QList<Sources> m_queue;
+    bool m_exiting;
+};
+
+struct ShaderProgramCache::ThreadToken
+{
+    ThreadToken()
+        : id(nextId.fetchAndAddRelaxed(1) + 1)
+    {
+    }
+
+    ~ThreadToken()
+    {
+        ShaderProgramCache::instance()->releaseThread(id);
+    }
+
+    static QAtomicInteger<quint64> nextId;
+    const quint64 id;
+};
+
+QAtomicInteger<quint64> ShaderProgramCache::ThreadToken::nextId;
+
+static QByteArray programKey(const QByteArray &vertexShader,
+                             const QByteArray &fragmentShader,
+                             const ShaderProgramCache::AttributeLocations &attributes)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(vertexShader);
+    hash.addData("\0", 1);
+    hash.addData(fragmentShader);
+    for (const auto &attribute : attributes) {
+        hash.addData(attribute.first);
+        hash.addData(QByteArray::number(attribute.second));
+    }
+    return hash.result();
+}
+
+ShaderProgramCache::ShaderProgramCache()
+    : m_warmUpThread(nullptr)
+{
+}
+
+ShaderProgramCache* ShaderProgramCache::instance()
+{
+    static ShaderProgramCache cache;
+    return &cache;
+}
+
+std::shared_ptr<QOpenGLShaderProgram> ShaderProgramCache::program(const QByteArray &vertexShader,
+                                                                  const QByteArray &fragmentShader,
+                                                                  const AttributeLocations &attributes)
+{
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context) {
+        qWarning() << "OpenGL context is not current, cannot build shader program";
+        return nullptr;
+    }
+
+    QOpenGLContextGroup *group = context->shareGroup();
+    const quint64 thread = currentThreadToken();
+    const QByteArray key = programKey(vertexShader, fragmentShader, attributes);
+
+    {
+        QMutexLocker locker(&m_mutex);
+        for (int i = m_entries.size() - 1; i >= 0; i--) {
+            const Entry &entry = m_entries.at(i);
+            // Programs of a destroyed share group went away with it
+            if (!entry.group) {
+                m_entries.removeAt(i);
+                continue;
+            }
+            if (entry.group == group && entry.thread == thread && entry.key == key)
+                return entry.program;
+        }
+    }
+
+    std::shared_ptr<QOpenGLShaderProgram> program = build(vertexShader, fragmentShader, attributes);
+    if (!program)
+        return nullptr;
+
+    Entry entry;
+    entry.group = group;
+    entry.thread = thread;
+    entry.key = key;
+    entry.program = program;
+
+    QMutexLocker locker(&m_mutex);
+    m_entries.append(entry);
+    return program;
+}
+
+void ShaderProgramCache::warmUp(const QByteArray &vertexShader,
+                                const QByteArray &fragmentShader,
+                                const AttributeLocations &attributes)
+{
+    if (!qobject_cast<QGuiApplication*>(QCoreApplication::instance()) ||
+            QThread::currentThread() != QCoreApplication::instance()->thread()) {
+        return;
+    }
+    if (!QOpenGLContext::supportsThreadedOpenGL())
+        return;
+
+    ShaderWarmUpThread::Sources sources;
+    sources.vertexShader = vertexShader;
+    sources.fragmentShader = fragmentShader;
+    sources.attributes = attributes;
+
+    QMutexLocker locker(&m_mutex);
+    if (m_warmUpThread && !m_warmUpThread->enqueue(sources)) {
+        // The thread ran out of work and is exiting, start a new one
+        delete m_warmUpThread;
+        m_warmUpThread = nullptr;
+    }
+    if (!m_warmUpThread) {
+        m_warmUpThread = new ShaderWarmUpThread;
+        m_warmUpThread->enqueue(sources);
+        m_warmUpThread->start(QThread::LowPriority);
+    }
+}
+
+quint64 ShaderProgramCache::currentThreadToken()
+{
+    static thread_local ThreadToken token;
+    return token.id;
+}
+
+/** Drops the programs of a thread that ends. Their GL objects are released
+ *  by their share group.
+ */
+void ShaderProgramCache::releaseThread(quint64 thread)
+{
+    QList<Entry> released;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (int i = m_entries.size() - 1; i >= 0; i--) {
+            if (m_entries.at(i).thread == thread)
+                released.append(m_entries.takeAt(i));
+        }
+    }
+}
+
+std::shared_ptr<QOpenGLShaderProgram> ShaderProgramCache::build(const QByteArray &vertexShader,
+                                                                const QByteArray &fragmentShader,
+                                                                const AttributeLocations &attributes)
+{
+    auto program = std::make_shared<QOpenGLShaderProgram>();
+
+    if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vertexShader)) {
+        qWarning() << "Failed to compile vertex shader. Reason:" << program->log();
+        return nullptr;
+    }
+
+    if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShader)) {
+        qWarning() << "Failed to compile fragment shader. Reason:" << program->log();
+        return nullptr;
+    }
+
+    for (const auto &attribute : attributes)
+        program->bindAttributeLocation(attribute.first, attribute.second);
+
+    if (!program->link()) {
+        qWarning() << "Failed to link shader. Reason:" << program->log();
+        return nullptr;
+    }
+
+    return program;
+}
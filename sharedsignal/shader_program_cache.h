@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2013-2014 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHADER_PROGRAM_CACHE_H
+#define SHADER_PROGRAM_CACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QPointer>
+
+#include <memory>
+
+class QOpenGLContextGroup;
+class QOpenGLShaderProgram;
+class ShaderWarmUpThread;
+
+/** Process wide cache of linked shader programs, shared by the camera and
+ *  video node plugins.
+ *
+ *  Programs are shared within a GL context share group, and by the users of
+ *  one thread only, since uniforms are program state. Programs are compiled
+ *  through the Qt program binary cache, which persists them on disk where
+ *  GL_OES_get_program_binary is available, so that only the first run on a
+ *  device pays for shader compilation.
+ */
+class ShaderProgramCache
+{
+public:
+    typedef QList<QPair<QByteArray, int> > AttributeLocations;
+
+    static ShaderProgramCache* instance();
+
+    /** Returns the program for the given sources, linked in the share group
+     *  of the current context, or nullptr if it fails to build.
+     */
+    std::shared_ptr<QOpenGLShaderProgram> program(const QByteArray &vertexShader,
+                                                  const QByteArray &fragmentShader,
+                                                  const AttributeLocations &attributes = AttributeLocations());
+
+    /** Builds the given sources in the background, so that their binaries
+     *  are on disk by the time they are first needed. Has to be called from
+     *  the GUI thread.
+     */
+    void warmUp(const QByteArray &vertexShader,
+                const QByteArray &fragmentShader,
+                const AttributeLocations &attributes = AttributeLocations());
+
+    static std::shared_ptr<QOpenGLShaderProgram> build(const QByteArray &vertexShader,
+                                                       const QByteArray &fragmentShader,
+                                                       const AttributeLocations &attributes);
+
+private:
+    /** Identifies the running thread, and drops its programs when it ends.
+     *  Tokens are never reused, unlike QThread pointers.
+     */
+    struct ThreadToken;
+
+    struct Entry {
+        QPointer<QOpenGLContextGroup> group;
+        quint64 thread;
+        QByteArray key;
+        std::shared_ptr<QOpenGLShaderProgram> program;
+    };
+
+    ShaderProgramCache();
+    Q_DISABLE_COPY(ShaderProgramCache);
+
+    static quint64 currentThreadToken();
+    void releaseThread(quint64 thread);
+
+    QMutex m_mutex;
+    QList<Entry> m_entries;
+    ShaderWarmUpThread *m_warmUpThread;
+};
+
+#endif // SHADER_PROGRAM_CACHE_H
@@ -1,14 +1,19 @@
 include(../coverage.pri)
 TARGET = sharedsignal
 TEMPLATE = lib
+CONFIG += c++11
 QT += gui
 
 target.path += $$[QT_INSTALL_PLUGINS]/../..
 INSTALLS = target
 
 HEADERS += \
-    media_signals.h
+    camera_channel.h \
+    media_signals.h \
+    shader_program_cache.h
 
 SOURCES += \
-    media_signals.cpp
+    camera_channel.cpp \
+    media_signals.cpp \
+    shader_program_cache.cpp
 
@@ -171,7 +171,6 @@ void AalCameraControl::handleError()
 
 void AalCameraControl::errorCB(void *context)
 {
-    Q_UNUSED(context);
-    QMetaObject::invokeMethod(AalCameraService::instance()->cameraControl(),
+    QMetaObject::invokeMethod(AalCameraService::fromContext(context)->cameraControl(),
                               "handleError", Qt::QueuedConnection);
 }
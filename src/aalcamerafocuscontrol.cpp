@@ -123,9 +123,9 @@ void AalCameraFocusControl::setFocusPointMode(QCameraFocus::FocusPointMode mode)
 
 void AalCameraFocusControl::focusCB(void *context)
 {
-    Q_UNUSED(context);
-    AalCameraService::instance()->focusControl()->m_focusRunning = false;
-    QMetaObject::invokeMethod(AalCameraService::instance(),
+    AalCameraService *service = AalCameraService::fromContext(context);
+    service->focusControl()->m_focusRunning = false;
+    QMetaObject::invokeMethod(service,
                               "updateCaptureReady", Qt::QueuedConnection);
 }
 
@@ -25,6 +25,8 @@
 #include "aalmetadatawritercontrol.h"
 #include "aalvideodeviceselectorcontrol.h"
 #include "aalvideoencodersettingscontrol.h"
+#include "aalvideoprobecontrol.h"
+#include "aalvideoprober.h"
 #include "aalvideorenderercontrol.h"
 #include "aalviewfindersettingscontrol.h"
 #include "aalcamerainfocontrol.h"
@@ -37,15 +39,11 @@
 #include <QDebug>
 #include <cmath>
 
-AalCameraService *AalCameraService::m_service = 0;
-
 AalCameraService::AalCameraService(QObject *parent):
     QMediaService(parent),
     m_androidControl(0),
     m_androidListener(0)
 {
-    m_service = this;
-
     m_storageManager = new StorageManager;
     m_cameraControl = new AalCameraControl(this);
     m_flashControl = new AalCameraFlashControl(this);
@@ -61,6 +59,7 @@ AalCameraService::AalCameraService(QObject *parent):
     m_viewfinderControl = new AalViewfinderSettingsControl(this);
     m_exposureControl = new AalCameraExposureControl(this);
     m_infoControl = new AalCameraInfoControl(this);
+    m_videoProber = new AalVideoProber();
     m_rotationHandler = new RotationHandler(this);
 }
 
@@ -82,6 +81,7 @@ AalCameraService::~AalCameraService()
     delete m_viewfinderControl;
     delete m_exposureControl;
     delete m_infoControl;
+    delete m_videoProber;
     if (m_androidControl)
         android_camera_delete(m_androidControl);
     delete m_storageManager;
@@ -132,12 +132,24 @@ QMediaControl *AalCameraService::requestControl(const char *name)
     if (qstrcmp(name, QCameraInfoControl_iid) == 0)
         return m_infoControl;
 
+    // Every probe gets its own control, frames are only mapped for probes
+    // while at least one is attached
+    if (qstrcmp(name, QMediaVideoProbeControl_iid) == 0) {
+        AalVideoProbeControl *probe = new AalVideoProbeControl(this);
+        m_videoProber->addProbe(probe);
+        return probe;
+    }
+
     return 0;
 }
 
 void AalCameraService::releaseControl(QMediaControl *control)
 {
-    Q_UNUSED(control);
+    AalVideoProbeControl *probe = qobject_cast<AalVideoProbeControl*>(control);
+    if (probe) {
+        m_videoProber->removeProbe(probe);
+        delete probe;
+    }
 }
 
 CameraControl *AalCameraService::androidControl()
@@ -170,7 +182,9 @@ bool AalCameraService::connectCamera()
         return false;
     }
 
-    m_androidListener->context = m_androidControl;
+    // HAL callbacks find the service they are for through the context,
+    // so that several cameras can be used at the same time
+    m_androidListener->context = this;
     initControls(m_androidControl, m_androidListener);
 
     this->m_cameraControl->setStatus(QCamera::LoadedStatus);
@@ -33,6 +33,7 @@ class AalVideoDeviceSelectorControl;
 class AalVideoEncoderSettingsControl;
 class AalVideoRendererControl;
 class AalViewfinderSettingsControl;
+class AalVideoProber;
 class AalCameraExposureControl;
 class AalCameraInfoControl;
 class QCameraControl;
@@ -67,6 +68,7 @@ public:
     AalViewfinderSettingsControl *viewfinderControl() const { return m_viewfinderControl; }
     AalCameraExposureControl *exposureControl() const { return m_exposureControl; }
     AalCameraInfoControl *infoControl() const { return m_infoControl; }
+    AalVideoProber *videoProber() const { return m_videoProber; }
 
     CameraControl *androidControl();
 
@@ -88,7 +90,8 @@ public:
     bool isRecording() const;
     QSize selectSizeWithAspectRatio(const QList<QSize> &sizes, float targetAspectRatio) const;
 
-    static AalCameraService *instance() { return m_service; }
+    // Service a HAL callback is for, from the context of its listener
+    static AalCameraService *fromContext(void *context) { return static_cast<AalCameraService*>(context); }
 
 public Q_SLOTS:
     void updateCaptureReady();
@@ -96,8 +99,6 @@ public Q_SLOTS:
 private:
     void initControls(CameraControl *camControl, CameraControlListener *listener);
 
-    static AalCameraService *m_service;
-
     AalCameraControl *m_cameraControl;
     AalCameraFlashControl *m_flashControl;
     AalCameraFocusControl *m_focusControl;
@@ -112,6 +113,7 @@ private:
     AalViewfinderSettingsControl *m_viewfinderControl;
     AalCameraExposureControl *m_exposureControl;
     AalCameraInfoControl *m_infoControl;
+    AalVideoProber *m_videoProber;
 
     CameraControl *m_androidControl;
     CameraControlListener *m_androidListener;
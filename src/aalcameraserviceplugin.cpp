@@ -16,6 +16,7 @@
 
 #include "aalcameraserviceplugin.h"
 #include "aalcameraservice.h"
+#include "aaltexturebuffermapper.h"
 
 #include <QByteArray>
 #include <QDebug>
@@ -44,6 +45,9 @@ AalServicePlugin::AalServicePlugin()
         deviceList.append(camera.toLatin1());
         qWarning() << "Added camera" << camera;
     }
+
+    // Compile the viewfinder readback shaders while the camera starts up
+    AalTextureBufferMapper::warmUpShaders();
 }
 
 QMediaService* AalServicePlugin::create(QString const& key)
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aalframestatistics.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+
+static const char* const METRIC_NAMES[AalFrameStatistics::MetricCount] = {
+    "callbackToPresent",
+    "presentToRender",
+    "mapDuration"
+};
+
+AalFrameStatistics::Summary::Summary() :
+    count(0),
+    p50(0),
+    p90(0),
+    p99(0),
+    max(0)
+{
+}
+
+AalFrameStatistics::Window::Window() :
+    next(0)
+{
+}
+
+AalFrameStatistics::AalFrameStatistics()
+{
+    for (int i = 0; i < MetricCount; i++) {
+        m_windows[i].samples.reserve(WindowSize);
+    }
+}
+
+void AalFrameStatistics::addSample(Metric metric, qint64 usecs)
+{
+    QMutexLocker locker(&m_mutex);
+    Window &window = m_windows[metric];
+    if (window.samples.size() < WindowSize) {
+        window.samples.append(usecs);
+    } else {
+        window.samples[window.next] = usecs;
+    }
+    window.next = (window.next + 1) % WindowSize;
+}
+
+/*!
+ * \brief AalFrameStatistics::summary returns the percentiles of the samples
+ * currently in the window of a metric
+ */
+AalFrameStatistics::Summary AalFrameStatistics::summary(Metric metric) const
+{
+    QVector<qint64> samples;
+    {
+        QMutexLocker locker(&m_mutex);
+        samples = m_windows[metric].samples;
+    }
+
+    Summary result;
+    if (samples.isEmpty())
+        return result;
+
+    std::sort(samples.begin(), samples.end());
+    const int last = samples.size() - 1;
+    result.count = samples.size();
+    result.p50 = samples.at(last * 50 / 100);
+    result.p90 = samples.at(last * 90 / 100);
+    result.p99 = samples.at(last * 99 / 100);
+    result.max = samples.at(last);
+    return result;
+}
+
+/*!
+ * \brief AalFrameStatistics::toVariantMap returns the summaries of all metrics,
+ * keyed by metric name
+ */
+QVariantMap AalFrameStatistics::toVariantMap() const
+{
+    QVariantMap map;
+    for (int i = 0; i < MetricCount; i++) {
+        const Summary s = summary(static_cast<Metric>(i));
+        QVariantMap values;
+        values.insert("count", s.count);
+        values.insert("p50", s.p50);
+        values.insert("p90", s.p90);
+        values.insert("p99", s.p99);
+        values.insert("max", s.max);
+        map.insert(METRIC_NAMES[i], values);
+    }
+    return map;
+}
+
+void AalFrameStatistics::reset()
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < MetricCount; i++) {
+        m_windows[i].samples.clear();
+        m_windows[i].next = 0;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AALFRAMESTATISTICS_H
+#define AALFRAMESTATISTICS_H
+
+#include <QMutex>
+#include <QVariantMap>
+#include <QVector>
+
+/*!
+ * \brief The AalFrameStatistics class keeps the latest latency samples of the
+ * viewfinder pipeline, and summarizes them as percentiles
+ * Samples are in microseconds and may be added from any thread.
+ */
+class AalFrameStatistics
+{
+public:
+    enum Metric {
+        CallbackToPresent,
+        PresentToRender,
+        MapDuration,
+        MetricCount
+    };
+
+    struct Summary {
+        Summary();
+
+        int count;
+        qint64 p50;
+        qint64 p90;
+        qint64 p99;
+        qint64 max;
+    };
+
+    // Number of samples kept per metric, about 4 seconds at 30 fps
+    static const int WindowSize = 120;
+
+    AalFrameStatistics();
+
+    void addSample(Metric metric, qint64 usecs);
+    Summary summary(Metric metric) const;
+    QVariantMap toVariantMap() const;
+    void reset();
+
+private:
+    struct Window {
+        Window();
+
+        QVector<qint64> samples;
+        int next;
+    };
+
+    mutable QMutex m_mutex;
+    Window m_windows[MetricCount];
+};
+
+#endif // AALFRAMESTATISTICS_H
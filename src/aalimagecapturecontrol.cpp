@@ -104,20 +104,17 @@ void AalImageCaptureControl::cancelCapture()
 
 void AalImageCaptureControl::shutterCB(void *context)
 {
-    Q_UNUSED(context);
-    QMetaObject::invokeMethod(AalCameraService::instance()->imageCaptureControl(),
+    QMetaObject::invokeMethod(AalCameraService::fromContext(context)->imageCaptureControl(),
                               "shutter", Qt::QueuedConnection);
 }
 
 void AalImageCaptureControl::saveJpegCB(void *data, uint32_t data_size, void *context)
 {
-    Q_UNUSED(context);
-
     // Copy the data buffer so that it is safe to pass it off to another thread,
     // since it will be destroyed once this function returns
     QByteArray dataCopy((const char*)data, data_size);
 
-    QMetaObject::invokeMethod(AalCameraService::instance()->imageCaptureControl(),
+    QMetaObject::invokeMethod(AalCameraService::fromContext(context)->imageCaptureControl(),
                               "saveJpeg", Qt::QueuedConnection,
                               Q_ARG(QByteArray, dataCopy));
 }
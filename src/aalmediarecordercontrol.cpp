@@ -260,8 +260,7 @@ void AalMediaRecorderControl::deleteAudioCapture()
  */
 void AalMediaRecorderControl::errorCB(void *context)
 {
-    Q_UNUSED(context);
-    QMetaObject::invokeMethod(AalCameraService::instance()->mediaRecorderControl(),
+    QMetaObject::invokeMethod(static_cast<AalMediaRecorderControl*>(context),
                               "handleError", Qt::QueuedConnection);
 }
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "aalpreviewframepool.h"
+
+#include <QAbstractVideoBuffer>
+#include <QDebug>
+
+#include <cstring>
+
+class AalPreviewFrameBuffer : public QAbstractVideoBuffer
+{
+public:
+    AalPreviewFrameBuffer(const std::shared_ptr<AalPreviewFramePool::Slot> &slot, int bytesPerLine) :
+        QAbstractVideoBuffer(QAbstractVideoBuffer::NoHandle),
+        m_slot(slot),
+        m_bytesPerLine(bytesPerLine),
+        m_mapMode(QAbstractVideoBuffer::NotMapped)
+    {
+    }
+
+    ~AalPreviewFrameBuffer()
+    {
+        // Hand the memory back to the pool
+        m_slot->inUse.storeRelease(0);
+    }
+
+    MapMode mapMode() const
+    {
+        return m_mapMode;
+    }
+
+    uchar *map(MapMode mode, int *numBytes, int *bytesPerLine)
+    {
+        if (mode != QAbstractVideoBuffer::ReadOnly) {
+            qWarning() << "Tried to map in unsupported mode:" << mode;
+            return nullptr;
+        }
+
+        m_mapMode = mode;
+        *numBytes = m_slot->data.size();
+        *bytesPerLine = m_bytesPerLine;
+        return m_slot->data.data();
+    }
+
+    void unmap()
+    {
+        m_mapMode = QAbstractVideoBuffer::NotMapped;
+    }
+
+private:
+    std::shared_ptr<AalPreviewFramePool::Slot> m_slot;
+    int m_bytesPerLine;
+    MapMode m_mapMode;
+};
+
+AalPreviewFramePool::Slot::Slot()
+{
+}
+
+AalPreviewFramePool::AalPreviewFramePool()
+{
+    for (int i = 0; i < PoolSize; i++) {
+        m_slots.push_back(std::make_shared<Slot>());
+    }
+}
+
+/*!
+ * \brief AalPreviewFramePool::frame copies an NV21 preview frame into a free
+ * buffer of the pool
+ * \return an invalid frame if no buffer is free or the data does not match the
+ * frame size
+ */
+QVideoFrame AalPreviewFramePool::frame(const void *data, uint size, const QSize &frameSize)
+{
+    const uint expectedSize = frameSize.width() * frameSize.height() * 3 / 2;
+    if (size < expectedSize) {
+        qWarning() << "Preview frame of" << size << "bytes is too small for" << frameSize;
+        return QVideoFrame();
+    }
+
+    for (size_t i = 0; i < m_slots.size(); i++) {
+        const std::shared_ptr<Slot> &slot = m_slots[i];
+        if (!slot->inUse.testAndSetAcquire(0, 1)) {
+            continue;
+        }
+
+        // Buffers are only reallocated when the preview size changes
+        slot->data.resize(expectedSize);
+        memcpy(slot->data.data(), data, expectedSize);
+        return QVideoFrame(new AalPreviewFrameBuffer(slot, frameSize.width()),
+                           frameSize, QVideoFrame::Format_NV21);
+    }
+
+    return QVideoFrame();
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AALPREVIEWFRAMEPOOL_H
+#define AALPREVIEWFRAMEPOOL_H
+
+#include <QAtomicInt>
+#include <QSize>
+#include <QVideoFrame>
+
+#include <memory>
+#include <vector>
+
+/*!
+ * \brief The AalPreviewFramePool class copies NV21 preview frames delivered by
+ * the HAL preview callback into a fixed set of recycled buffers
+ * A buffer goes back to the pool once the last QVideoFrame referencing it is
+ * destroyed. When every buffer is still in use, new frames are dropped
+ * instead of allocating more memory.
+ */
+class AalPreviewFramePool
+{
+public:
+    struct Slot {
+        Slot();
+
+        std::vector<uchar> data;
+        QAtomicInt inUse;
+    };
+
+    static const int PoolSize = 4;
+
+    AalPreviewFramePool();
+
+    QVideoFrame frame(const void *data, uint size, const QSize &frameSize);
+
+private:
+    Q_DISABLE_COPY(AalPreviewFramePool)
+
+    std::vector<std::shared_ptr<Slot> > m_slots;
+};
+
+#endif // AALPREVIEWFRAMEPOOL_H
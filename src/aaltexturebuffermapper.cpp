@@ -0,0 +1,1310 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aaltexturebuffermapper.h"
+#include "shader_program_cache.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLShaderProgram>
+#include <QSet>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QVector4D>
+
+#include <hybris/properties/properties.h>
+#include <hybris/ui/ui_compatibility_layer.h>
+#include <hardware/gralloc.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#ifndef GL_TEXTURE_EXTERNAL_OES
+#define GL_TEXTURE_EXTERNAL_OES 0x8D65
+#endif
+
+#ifndef EGL_SYNC_NATIVE_FENCE_ANDROID
+#define EGL_SYNC_NATIVE_FENCE_ANDROID 0x3144
+#endif
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+
+const int32_t GB_FORMAT = HAL_PIXEL_FORMAT_RGBA_8888;
+const uint32_t GB_ALLOC_USAGE =
+        GRALLOC_USAGE_HW_TEXTURE |
+        GRALLOC_USAGE_SW_READ_OFTEN |
+        GRALLOC_USAGE_SW_WRITE_NEVER;
+
+static const GLchar* VERTEX_SHADER = {
+    "#version 100\n"
+    "attribute highp vec3 vertexCoord;\n"
+    "attribute highp vec2 textureCoord;\n"
+    "uniform highp vec4 crop;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    uv = crop.xy + textureCoord.xy * crop.zw;\n"
+    "    gl_Position = vec4(vertexCoord,1.0);\n"
+    "}\n"
+};
+
+static const GLchar* BGRA_FRAGMENT_SHADER = {
+    "#version 100\n"
+    "#extension GL_OES_EGL_image_external : require\n"
+    "uniform samplerExternalOES tex;\n"
+    "varying highp vec2 uv;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor.bgra = texture2D(tex, uv).bgra;\n"
+    "}\n"
+};
+
+// The YUV shaders render into an RGBA target a quarter of the frame wide,
+// packing four 8 bit samples into each output pixel. The first frameSize.y
+// rows hold the luma plane, the following frameSize.y / 2 rows the chroma
+// samples, each one taken at the centre of its 2x2 block (BT.601, limited range).
+// frameSize is the size of the mapped frame, which covers the crop rectangle
+// of the viewfinder texture.
+#define YUV_FRAGMENT_SHADER_HEADER \
+    "#version 100\n" \
+    "#extension GL_OES_EGL_image_external : require\n" \
+    "precision highp float;\n" \
+    "uniform samplerExternalOES tex;\n" \
+    "uniform vec2 frameSize;\n" \
+    "uniform highp vec4 crop;\n" \
+    "varying highp vec2 uv;\n" \
+    "\n" \
+    "vec3 rgbAt(vec2 pos) {\n" \
+    "    return texture2D(tex, crop.xy + pos / frameSize * crop.zw).rgb;\n" \
+    "}\n" \
+    "float luma(vec3 c) {\n" \
+    "    return dot(c, vec3(0.257, 0.504, 0.098)) + 0.0625;\n" \
+    "}\n" \
+    "vec2 chroma(vec3 c) {\n" \
+    "    return vec2(dot(c, vec3(-0.148, -0.291, 0.439)),\n" \
+    "                dot(c, vec3(0.439, -0.368, -0.071))) + 0.5;\n" \
+    "}\n" \
+    "vec4 lumaAt(vec2 outPos) {\n" \
+    "    float x = outPos.x * 4.0;\n" \
+    "    float y = outPos.y + 0.5;\n" \
+    "    return vec4(luma(rgbAt(vec2(x + 0.5, y))), luma(rgbAt(vec2(x + 1.5, y))),\n" \
+    "                luma(rgbAt(vec2(x + 2.5, y))), luma(rgbAt(vec2(x + 3.5, y))));\n" \
+    "}\n"
+
+// Semi-planar: each chroma row interleaves U and V samples, so an output
+// pixel holds two UV pairs covering four frame pixels
+static const GLchar* NV12_FRAGMENT_SHADER = {
+    YUV_FRAGMENT_SHADER_HEADER
+    "\n"
+    "void main() {\n"
+    "    vec2 outPos = floor(gl_FragCoord.xy);\n"
+    "    if (outPos.y < frameSize.y) {\n"
+    "        gl_FragColor = lumaAt(outPos);\n"
+    "    } else {\n"
+    "        float x = outPos.x * 4.0 + 1.0;\n"
+    "        float y = (outPos.y - frameSize.y) * 2.0 + 1.0;\n"
+    "        gl_FragColor = vec4(chroma(rgbAt(vec2(x, y))), chroma(rgbAt(vec2(x + 2.0, y))));\n"
+    "    }\n"
+    "}\n"
+};
+
+// Planar: each chroma row holds a row of the U plane in its left half and
+// the matching row of the V plane in its right half
+static const GLchar* I420_FRAGMENT_SHADER = {
+    YUV_FRAGMENT_SHADER_HEADER
+    "\n"
+    "void main() {\n"
+    "    vec2 outPos = floor(gl_FragCoord.xy);\n"
+    "    if (outPos.y < frameSize.y) {\n"
+    "        gl_FragColor = lumaAt(outPos);\n"
+    "    } else {\n"
+    "        float halfWidth = frameSize.x * 0.5;\n"
+    "        float x = outPos.x * 4.0;\n"
+    "        bool v = x >= halfWidth;\n"
+    "        if (v)\n"
+    "            x -= halfWidth;\n"
+    "        x = x * 2.0 + 1.0;\n"
+    "        float y = (outPos.y - frameSize.y) * 2.0 + 1.0;\n"
+    "        vec2 c0 = chroma(rgbAt(vec2(x, y)));\n"
+    "        vec2 c1 = chroma(rgbAt(vec2(x + 2.0, y)));\n"
+    "        vec2 c2 = chroma(rgbAt(vec2(x + 4.0, y)));\n"
+    "        vec2 c3 = chroma(rgbAt(vec2(x + 6.0, y)));\n"
+    "        gl_FragColor = v ? vec4(c0.y, c1.y, c2.y, c3.y) : vec4(c0.x, c1.x, c2.x, c3.x);\n"
+    "    }\n"
+    "}\n"
+};
+
+// Mapper whose uniform values each shared copy program of this thread holds
+static thread_local QHash<const QOpenGLShaderProgram*, const AalTextureBufferMapper*> s_programUsers;
+
+static bool isYuvFormat(QVideoFrame::PixelFormat format)
+{
+    return format == QVideoFrame::Format_NV12 || format == QVideoFrame::Format_YUV420P;
+}
+
+AalTextureBufferMapper::AalTextureBufferMapper() :
+    m_textureId(0),
+    m_width(0),
+    m_height(0),
+    m_cropRect(0, 0, 1, 1),
+    m_mapMode(QAbstractVideoBuffer::NotMapped),
+    m_mapStatus(MapOk),
+    m_readbackMode(AalVideoRendererControl::ExactReadback),
+    m_pixelFormat(QVideoFrame::Format_RGB32),
+    m_frameSequence(0)
+{
+}
+
+AalTextureBufferMapper::~AalTextureBufferMapper()
+{
+    // GL objects can only be released with their context current,
+    // otherwise they go away together with the context itself
+    if (m_copyContext && m_copyContext == QOpenGLContext::currentContext()) {
+        releaseCopyPass();
+    }
+}
+
+/*!
+ * \brief AalTextureBufferMapper::isPixelFormatSupported returns true if frames
+ * of the given size can be mapped in the given pixel format
+ */
+bool AalTextureBufferMapper::isPixelFormatSupported(QVideoFrame::PixelFormat format, const QSize &size)
+{
+    if (format == QVideoFrame::Format_RGB32)
+        return true;
+
+    // The YUV conversion packs four samples per pixel, and I420 packs half
+    // a chroma row of each plane side by side
+    if (isYuvFormat(format))
+        return size.width() % 8 == 0 && size.height() % 2 == 0;
+
+    return false;
+}
+
+/*!
+ * \brief AalTextureBufferMapper::planes splits a mapped buffer into the planes
+ * of the current pixel format
+ * \return the number of planes
+ */
+int AalTextureBufferMapper::planes(uchar* bits, int bytesPerLine, int planeBytesPerLine[4], uchar* planeData[4]) const
+{
+    planeData[0] = bits;
+    planeBytesPerLine[0] = bytesPerLine;
+
+    if (m_pixelFormat != QVideoFrame::Format_YUV420P)
+        return 1;
+
+    // U and V rows are side by side, so both planes share the luma stride
+    planeData[1] = bits + bytesPerLine * m_height;
+    planeBytesPerLine[1] = bytesPerLine;
+    planeData[2] = planeData[1] + m_width / 2;
+    planeBytesPerLine[2] = bytesPerLine;
+    return 3;
+}
+
+/*!
+ * \brief AalTextureBufferMapper::targetSize returns the size, in RGBA pixels,
+ * of the buffer a frame is rendered into before being read back
+ */
+QSize AalTextureBufferMapper::targetSize() const
+{
+    if (isYuvFormat(m_pixelFormat))
+        return QSize(m_width / 4, m_height * 3 / 2);
+
+    return QSize(m_width, m_height);
+}
+
+AalTextureBufferMapper::CopyProgram::CopyProgram() :
+    cropLocation(-1),
+    frameSizeLocation(-1),
+    crop(-1, -1, -1, -1)
+{
+}
+
+/*!
+ * \brief AalTextureBufferMapper::renderWithShader draws the viewfinder texture
+ * into the bound framebuffer, converting it to the given format
+ * The quad, vertex array and programs are built once per context, and
+ * uniforms are only updated when their value changes.
+ */
+bool AalTextureBufferMapper::renderWithShader(QOpenGLFunctions* gl, QVideoFrame::PixelFormat format)
+{
+    // Objects of a lost context went away with it, build them again
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if (context != m_copyContext) {
+        releaseCopyPass();
+        m_copyContext = context;
+    }
+
+    if (!m_quadBuffer.isCreated() && !createQuad()) {
+        return false;
+    }
+
+    CopyProgram* copy = copyProgram(format);
+    if (!copy) {
+        return false;
+    }
+
+    const QSize size = targetSize();
+    QOpenGLShaderProgram* program = copy->program.get();
+
+    program->bind();
+
+    // Programs are shared with the other mappers of this thread, whose
+    // uniform values may have replaced ours
+    const AalTextureBufferMapper*& lastUser = s_programUsers[program];
+    if (lastUser != this) {
+        copy->crop = QVector4D(-1, -1, -1, -1);
+        copy->frameSize = QSizeF();
+        lastUser = this;
+    }
+
+    const QVector4D crop(m_cropRect.x(), m_cropRect.y(), m_cropRect.width(), m_cropRect.height());
+    if (copy->crop != crop) {
+        program->setUniformValue(copy->cropLocation, crop);
+        copy->crop = crop;
+    }
+    if (copy->frameSizeLocation != -1 && copy->frameSize != QSizeF(m_width, m_height)) {
+        copy->frameSize = QSizeF(m_width, m_height);
+        program->setUniformValue(copy->frameSizeLocation, copy->frameSize);
+    }
+
+    gl->glActiveTexture(GL_TEXTURE0 + CopyTextureUnit);
+    gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, m_textureId);
+
+    gl->glViewport(0, 0, size.width(), size.height());
+
+    // Without vertex array objects, the attributes are set up on every draw
+    if (m_vao.isCreated()) {
+        m_vao.bind();
+    } else {
+        bindQuadAttributes(gl);
+    }
+
+    gl->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    if (m_vao.isCreated()) {
+        m_vao.release();
+    } else {
+        gl->glDisableVertexAttribArray(TextureCoordLocation);
+        gl->glDisableVertexAttribArray(VertexCoordLocation);
+    }
+    program->release();
+
+    gl->glActiveTexture(GL_TEXTURE0);
+    return true;
+}
+
+bool AalTextureBufferMapper::createQuad()
+{
+    // Interleaved vertex and texture coordinates of a full viewport strip
+    static const GLfloat quad_data[] = {
+        -1, -1,  0, 0,
+         1, -1,  1, 0,
+        -1,  1,  0, 1,
+         1,  1,  1, 1
+    };
+
+    if (!m_quadBuffer.create()) {
+        qWarning() << "Failed to create vertex buffer";
+        return false;
+    }
+    m_quadBuffer.bind();
+    m_quadBuffer.allocate(quad_data, sizeof(quad_data));
+    m_quadBuffer.release();
+
+    // Attribute locations are the same for every program, so one vertex
+    // array serves them all
+    if (m_vao.create()) {
+        m_vao.bind();
+        bindQuadAttributes(m_copyContext->functions());
+        m_vao.release();
+    }
+    return true;
+}
+
+void AalTextureBufferMapper::bindQuadAttributes(QOpenGLFunctions* gl)
+{
+    const GLsizei stride = 4 * sizeof(GLfloat);
+
+    m_quadBuffer.bind();
+    gl->glVertexAttribPointer(VertexCoordLocation, 2, GL_FLOAT, GL_FALSE, stride, 0);
+    gl->glVertexAttribPointer(TextureCoordLocation, 2, GL_FLOAT, GL_FALSE, stride,
+                              reinterpret_cast<const void*>(2 * sizeof(GLfloat)));
+    gl->glEnableVertexAttribArray(VertexCoordLocation);
+    gl->glEnableVertexAttribArray(TextureCoordLocation);
+    m_quadBuffer.release();
+}
+
+AalTextureBufferMapper::CopyProgram* AalTextureBufferMapper::copyProgram(QVideoFrame::PixelFormat format)
+{
+    QHash<int, CopyProgram>::iterator it = m_programs.find(format);
+    if (it != m_programs.end()) {
+        return &it.value();
+    }
+
+    CopyProgram copy;
+    copy.program = compileShaders(format);
+    if (!copy.program) {
+        return nullptr;
+    }
+
+    copy.cropLocation = copy.program->uniformLocation("crop");
+    if (isYuvFormat(format)) {
+        copy.frameSizeLocation = copy.program->uniformLocation("frameSize");
+    }
+
+    // The texture unit never changes, set it once
+    copy.program->bind();
+    copy.program->setUniformValue("tex", CopyTextureUnit);
+    copy.program->release();
+
+    return &m_programs.insert(format, copy).value();
+}
+
+void AalTextureBufferMapper::releaseCopyPass()
+{
+    for (auto it = s_programUsers.begin(); it != s_programUsers.end();) {
+        if (it.value() == this) {
+            it = s_programUsers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_programs.clear();
+    if (m_vao.isCreated()) {
+        m_vao.destroy();
+    }
+    if (m_quadBuffer.isCreated()) {
+        m_quadBuffer.destroy();
+    }
+    m_copyContext = nullptr;
+}
+
+static const GLchar* fragmentShaderFor(QVideoFrame::PixelFormat format)
+{
+    if (format == QVideoFrame::Format_NV12) {
+        return NV12_FRAGMENT_SHADER;
+    } else if (format == QVideoFrame::Format_YUV420P) {
+        return I420_FRAGMENT_SHADER;
+    }
+    return BGRA_FRAGMENT_SHADER;
+}
+
+static ShaderProgramCache::AttributeLocations copyAttributeLocations(GLuint vertexCoordLocation,
+                                                                    GLuint textureCoordLocation)
+{
+    ShaderProgramCache::AttributeLocations attributes;
+    attributes.append(qMakePair(QByteArray("vertexCoord"), int(vertexCoordLocation)));
+    attributes.append(qMakePair(QByteArray("textureCoord"), int(textureCoordLocation)));
+    return attributes;
+}
+
+std::shared_ptr<QOpenGLShaderProgram> AalTextureBufferMapper::compileShaders(QVideoFrame::PixelFormat format)
+{
+    return ShaderProgramCache::instance()->program(
+                VERTEX_SHADER, fragmentShaderFor(format),
+                copyAttributeLocations(VertexCoordLocation, TextureCoordLocation));
+}
+
+/*!
+ * \brief AalTextureBufferMapper::warmUpShaders builds the copy programs of
+ * every supported format in the background, so that the first map() does not
+ * have to wait for the shader compiler
+ */
+void AalTextureBufferMapper::warmUpShaders()
+{
+    static const QVideoFrame::PixelFormat formats[] = {
+        QVideoFrame::Format_RGB32,
+        QVideoFrame::Format_NV12,
+        QVideoFrame::Format_YUV420P
+    };
+
+    for (QVideoFrame::PixelFormat format : formats) {
+        ShaderProgramCache::instance()->warmUp(
+                    VERTEX_SHADER, fragmentShaderFor(format),
+                    copyAttributeLocations(VertexCoordLocation, TextureCoordLocation));
+    }
+}
+
+AalTextureBufferGraphicMapper::Slot::Slot() :
+    graphicBuffer(nullptr),
+    eglImage(EGL_NO_IMAGE_KHR),
+    eglDisplay(EGL_NO_DISPLAY),
+    fence(EGL_NO_SYNC_KHR),
+    sequence(0),
+    texture(0),
+    fbo(0),
+    vramAddr(nullptr)
+{
+}
+
+AalTextureBufferGraphicMapper::AalTextureBufferGraphicMapper() :
+    AalTextureBufferMapper(),
+    m_current(-1),
+    m_next(0),
+    m_fenceDisplay(EGL_NO_DISPLAY),
+    m_fenceType(EGL_NONE)
+{
+    eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+    glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+    eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+    eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+    eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+}
+
+AalTextureBufferGraphicMapper::~AalTextureBufferGraphicMapper()
+{
+    for (int i = 0; i < RingSize; i++) {
+        destroySlot(m_slots[i]);
+    }
+}
+
+uchar* AalTextureBufferGraphicMapper::map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine)
+{
+    m_mapStatus = MapFailed;
+
+    if (mode != QAbstractVideoBuffer::ReadOnly) {
+        qWarning() << "Tried to map in unsupported mode:" << mode;
+        return nullptr;
+    }
+
+    if (m_width <= 0 || m_height <= 0) {
+        qWarning() << "Tried to map buffer of invalid dimensions, cannot map memory.";
+        return nullptr;
+    }
+
+    // Already mapped? Return the address then
+    if (m_current != -1) {
+        const Slot &slot = m_slots[m_current];
+        const int stride = graphic_buffer_get_stride(slot.graphicBuffer);
+        m_mapMode = mode;
+        m_mapStatus = MapOk;
+        *numBytes = slot.size.height() * stride * 4;
+        *bytesPerLine = stride * 4;
+        return (uchar*)slot.vramAddr;
+    }
+
+    if (!(eglCreateImageKHR && eglDestroyImageKHR && glEGLImageTargetTexture2DOES)) {
+        qWarning() << "EGLImageKHR functions not found, cannot map memory.";
+        return nullptr;
+    }
+
+    if (!QOpenGLContext::currentContext()) {
+        qWarning() << "OpenGL context is not current, cannot map memory.";
+        return nullptr;
+    }
+
+    QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
+
+    // Slots are only rebuilt when the frame size or format changed
+    const QSize size = targetSize();
+    Slot &slot = m_slots[m_next];
+    if (slot.size != size) {
+        destroySlot(slot);
+        if (!createSlot(gl, slot, size)) {
+            destroySlot(slot);
+            return nullptr;
+        }
+    }
+
+    // A copy left in flight by a non-blocking map is picked up if it holds
+    // the previous frame at most, so mapped frames lag by one frame at most.
+    // Older copies are dropped and made again.
+    if (slot.fence != EGL_NO_SYNC_KHR && m_frameSequence - slot.sequence > 1) {
+        eglDestroySyncKHR(slot.eglDisplay, slot.fence);
+        slot.fence = EGL_NO_SYNC_KHR;
+    }
+
+    if (slot.fence == EGL_NO_SYNC_KHR) {
+        // Draw the target texture to copy the viewfinder texture into the EGLImage
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, slot.fbo);
+        const bool rendered = renderWithShader(gl, m_pixelFormat);
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!rendered) {
+            return nullptr;
+        }
+        slot.sequence = m_frameSequence;
+
+        // Without fences, fall back to draining the whole pipeline
+        if (!insertFence(slot)) {
+            gl->glFinish();
+        }
+    }
+
+    if (!waitForFence(gl, slot)) {
+        m_mapStatus = MapNotReady;
+        return nullptr;
+    }
+
+    // Map pixel data from the GraphicBuffer
+    graphic_buffer_lock(slot.graphicBuffer, GRALLOC_USAGE_SW_READ_OFTEN, &slot.vramAddr);
+    if (!slot.vramAddr) {
+        qWarning() << "Failed to lock GraphicBuffer";
+        destroySlot(slot);
+        return nullptr;
+    }
+
+    m_current = m_next;
+
+    const int stride = graphic_buffer_get_stride(slot.graphicBuffer);
+    m_mapMode = mode;
+    m_mapStatus = MapOk;
+    *numBytes = size.height() * stride * 4;
+    *bytesPerLine = stride * 4;
+
+    return (uchar*)slot.vramAddr;
+}
+
+void AalTextureBufferGraphicMapper::unmap()
+{
+    if (m_current == -1) {
+        return;
+    }
+
+    // Keep the slot's buffers alive for the next frames, just hand the
+    // memory back to gralloc and move on to the next slot of the ring.
+    Slot &slot = m_slots[m_current];
+    graphic_buffer_unlock(slot.graphicBuffer);
+    slot.vramAddr = nullptr;
+
+    m_next = (m_current + 1) % RingSize;
+    m_current = -1;
+    m_mapMode = QAbstractVideoBuffer::NotMapped;
+}
+
+/*!
+ * \brief AalTextureBufferGraphicMapper::insertFence inserts a fence after the
+ * copy into the slot, so that only that copy is waited for before the
+ * GraphicBuffer is locked
+ * Native Android fences are preferred as they are backed by the kernel sync
+ * framework; plain EGL fences are used otherwise.
+ * \return false if fences are not supported
+ */
+bool AalTextureBufferGraphicMapper::insertFence(Slot &slot)
+{
+    if (!(eglCreateSyncKHR && eglDestroySyncKHR && eglClientWaitSyncKHR)) {
+        return false;
+    }
+
+    if (m_fenceDisplay != slot.eglDisplay) {
+        m_fenceDisplay = slot.eglDisplay;
+        const char* extensions = eglQueryString(m_fenceDisplay, EGL_EXTENSIONS);
+        const QList<QByteArray> names = QByteArray(extensions).split(' ');
+        if (names.contains("EGL_ANDROID_native_fence_sync")) {
+            m_fenceType = EGL_SYNC_NATIVE_FENCE_ANDROID;
+        } else if (names.contains("EGL_KHR_fence_sync")) {
+            m_fenceType = EGL_SYNC_FENCE_KHR;
+        } else {
+            m_fenceType = EGL_NONE;
+        }
+    }
+
+    if (m_fenceType == EGL_NONE) {
+        return false;
+    }
+
+    slot.fence = eglCreateSyncKHR(slot.eglDisplay, m_fenceType, nullptr);
+    if (slot.fence == EGL_NO_SYNC_KHR) {
+        qWarning() << "Failed to create EGL fence, error:" << eglGetError();
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief AalTextureBufferGraphicMapper::waitForFence waits for the copy into
+ * the slot to complete
+ * In NonBlockingReadback mode the fence is only polled, and the copy is left
+ * in flight if it has not completed yet, for the map of the next frame to
+ * pick up. map() then reports MapNotReady.
+ * \return false if the copy has not completed yet
+ */
+bool AalTextureBufferGraphicMapper::waitForFence(QOpenGLFunctions* gl, Slot &slot)
+{
+    if (slot.fence == EGL_NO_SYNC_KHR) {
+        return true;
+    }
+
+    const EGLTimeKHR timeout = m_readbackMode == AalVideoRendererControl::NonBlockingReadback
+            ? 0 : EGL_FOREVER_KHR;
+    const EGLint status = eglClientWaitSyncKHR(slot.eglDisplay, slot.fence,
+                                               EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, timeout);
+    if (status == EGL_TIMEOUT_EXPIRED_KHR) {
+        return false;
+    }
+
+    if (status == EGL_FALSE) {
+        qWarning() << "Failed to wait for EGL fence, error:" << eglGetError();
+        gl->glFinish();
+    }
+
+    eglDestroySyncKHR(slot.eglDisplay, slot.fence);
+    slot.fence = EGL_NO_SYNC_KHR;
+    return true;
+}
+
+bool AalTextureBufferGraphicMapper::createSlot(QOpenGLFunctions* gl, Slot &slot, const QSize &size)
+{
+    // Intermediate GraphicBuffer for accessing the texture through EGLImageKHR
+    slot.graphicBuffer = graphic_buffer_new_sized(size.width(), size.height(), GB_FORMAT, GB_ALLOC_USAGE);
+    if (!slot.graphicBuffer) {
+        qWarning() << "Failed to allocate GraphicBuffer of size" << size;
+        return false;
+    }
+
+    // Create EGLImageKHR from the GraphicBuffer for readback purposes
+    EGLClientBuffer eglClientBuffer = (EGLClientBuffer)graphic_buffer_get_native_buffer(slot.graphicBuffer);
+    EGLint attrs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE,
+                       EGL_NONE };
+    slot.eglDisplay = eglGetCurrentDisplay();
+    slot.eglImage = eglCreateImageKHR(slot.eglDisplay, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_ANDROID, eglClientBuffer, attrs);
+    if (slot.eglImage == EGL_NO_IMAGE_KHR) {
+        qWarning() << "Failed to create EGLImageKHR, error:" << eglGetError();
+        return false;
+    }
+
+    // Texture that is going to receive the viewfinder's data, bound with the EGLImage
+    gl->glGenTextures(1, &slot.texture);
+    gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, slot.texture);
+    gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, slot.eglImage);
+
+    gl->glGenFramebuffers(1, &slot.fbo);
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, slot.fbo);
+    gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_EXTERNAL_OES, slot.texture, 0);
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+
+    slot.size = size;
+    return true;
+}
+
+void AalTextureBufferGraphicMapper::destroySlot(Slot &slot)
+{
+    // GL objects can only be released with a current context, otherwise
+    // they go away together with the context itself.
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if (context) {
+        QOpenGLFunctions* gl = context->functions();
+        if (slot.fbo) {
+            gl->glDeleteFramebuffers(1, &slot.fbo);
+        }
+        if (slot.texture) {
+            gl->glDeleteTextures(1, &slot.texture);
+        }
+    }
+    slot.fbo = 0;
+    slot.texture = 0;
+
+    if (slot.fence != EGL_NO_SYNC_KHR && eglDestroySyncKHR) {
+        eglDestroySyncKHR(slot.eglDisplay, slot.fence);
+    }
+    slot.fence = EGL_NO_SYNC_KHR;
+
+    if (slot.eglImage != EGL_NO_IMAGE_KHR && eglDestroyImageKHR) {
+        eglDestroyImageKHR(slot.eglDisplay, slot.eglImage);
+    }
+    slot.eglImage = EGL_NO_IMAGE_KHR;
+    slot.eglDisplay = EGL_NO_DISPLAY;
+
+    if (slot.graphicBuffer) {
+        if (slot.vramAddr) {
+            graphic_buffer_unlock(slot.graphicBuffer);
+        }
+        graphic_buffer_free(slot.graphicBuffer);
+    }
+    slot.graphicBuffer = nullptr;
+    slot.vramAddr = nullptr;
+    slot.size = QSize();
+}
+
+AalTextureBufferPixelReadMapper::AalTextureBufferPixelReadMapper() :
+    AalTextureBufferMapper(),
+    m_fbo(0),
+    m_conversionFbo(0),
+    m_conversionTexture(0),
+    m_pboIndex(0),
+    m_pboPending(false),
+    m_pboSequence(0)
+{
+    for (int i = 0; i < PboRingSize; i++) {
+        m_pbos[i] = 0;
+    }
+}
+
+AalTextureBufferPixelReadMapper::~AalTextureBufferPixelReadMapper()
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if (context) {
+        QOpenGLFunctions* gl = context->functions();
+        if (m_fbo) {
+            gl->glDeleteFramebuffers(1, &m_fbo);
+        }
+        deleteConversionTarget(gl);
+        deletePixelPackBuffers(gl);
+    }
+}
+
+uchar* AalTextureBufferPixelReadMapper::map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine)
+{
+    m_mapStatus = MapFailed;
+
+    if (mode != QAbstractVideoBuffer::ReadOnly) {
+        qWarning() << "Tried to map in unsupported mode:" << mode;
+        return nullptr;
+    }
+
+    if (m_width <= 0 || m_height <= 0) {
+        qWarning() << "Tried to map buffer of invalid dimensions, cannot map memory.";
+        return nullptr;
+    }
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if (!context) {
+        qWarning() << "OpenGL context is not current, cannot map memory.";
+        return nullptr;
+    }
+
+    // The host buffer is only reallocated when the frame size changes
+    const QSize size = targetSize();
+    const int bufferSize = size.width() * size.height() * 4;
+    if ((int)m_pixelBuffer.size() != bufferSize) {
+        m_pixelBuffer.resize(bufferSize);
+    }
+
+    QOpenGLFunctions* gl = context->functions();
+    if (!bindReadFramebuffer(gl, size)) {
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return nullptr;
+    }
+
+    if (m_readbackMode != AalVideoRendererControl::ExactReadback && hasPixelPackBuffers(context)) {
+        readLatest(gl, context->extraFunctions(), size);
+    } else {
+        gl->glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, m_pixelBuffer.data());
+    }
+
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    gl->glBindTexture(GL_TEXTURE_2D, 0);
+
+    m_mapMode = mode;
+    m_mapStatus = MapOk;
+    *numBytes = bufferSize;
+    *bytesPerLine = size.width() * 4;
+    return m_pixelBuffer.data();
+}
+
+void AalTextureBufferPixelReadMapper::unmap()
+{
+    // The host buffer is kept around for the next frames
+    m_mapMode = QAbstractVideoBuffer::NotMapped;
+}
+
+bool AalTextureBufferPixelReadMapper::hasPixelPackBuffers(QOpenGLContext* context)
+{
+    // Pixel pack buffers and glMapBufferRange() need OpenGL ES 3.0
+    return context->format().majorVersion() >= 3;
+}
+
+/*!
+ * \brief AalTextureBufferPixelReadMapper::bindReadFramebuffer binds a
+ * framebuffer holding the current frame in the mapped pixel format
+ * Full size RGB frames are read straight from the viewfinder texture, YUV,
+ * scaled or cropped frames are first rendered into an intermediate texture.
+ */
+bool AalTextureBufferPixelReadMapper::bindReadFramebuffer(QOpenGLFunctions* gl, const QSize &size)
+{
+    if (!isYuvFormat(m_pixelFormat) && isWholeTexture()) {
+        if (!m_fbo) {
+            gl->glGenFramebuffers(1, &m_fbo);
+        }
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+        gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, m_textureId);
+        gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_EXTERNAL_OES, m_textureId, 0);
+        return true;
+    }
+
+    if (m_conversionSize != size) {
+        deleteConversionTarget(gl);
+
+        gl->glGenTextures(1, &m_conversionTexture);
+        gl->glBindTexture(GL_TEXTURE_2D, m_conversionTexture);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width(), size.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+        gl->glGenFramebuffers(1, &m_conversionFbo);
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, m_conversionFbo);
+        gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_conversionTexture, 0);
+        m_conversionSize = size;
+    }
+
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, m_conversionFbo);
+    return renderWithShader(gl, m_pixelFormat);
+}
+
+/*!
+ * \brief AalTextureBufferPixelReadMapper::readLatest starts an asynchronous
+ * copy of the current frame into one pixel pack buffer, and reads back the one
+ * started on the previous call. This turns the pipeline stall of
+ * glReadPixels() into one frame of latency.
+ * A consumer mapping less often than every frame would get an older frame
+ * back, so a copy of anything but the previous frame is dropped, and the
+ * current frame is read synchronously instead.
+ */
+void AalTextureBufferPixelReadMapper::readLatest(QOpenGLFunctions* gl, QOpenGLExtraFunctions* extra, const QSize &size)
+{
+    const int bufferSize = size.width() * size.height() * 4;
+
+    if (m_pboSize != size) {
+        deletePixelPackBuffers(gl);
+        gl->glGenBuffers(PboRingSize, m_pbos);
+        for (int i = 0; i < PboRingSize; i++) {
+            gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[i]);
+            gl->glBufferData(GL_PIXEL_PACK_BUFFER, bufferSize, nullptr, GL_STREAM_READ);
+        }
+        m_pboSize = size;
+    }
+
+    gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[m_pboIndex]);
+    gl->glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    const bool previousFrame = m_pboPending && m_frameSequence - m_pboSequence <= 1;
+    if (previousFrame) {
+        const int previous = (m_pboIndex + PboRingSize - 1) % PboRingSize;
+        gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[previous]);
+        void* data = extra->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bufferSize, GL_MAP_READ_BIT);
+        if (data) {
+            memcpy(m_pixelBuffer.data(), data, bufferSize);
+            extra->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            qWarning() << "Failed to map pixel pack buffer";
+        }
+        gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    } else {
+        // Nothing recent has been read back, so block on this frame
+        gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        gl->glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, m_pixelBuffer.data());
+    }
+
+    m_pboPending = true;
+    m_pboSequence = m_frameSequence;
+    m_pboIndex = (m_pboIndex + 1) % PboRingSize;
+}
+
+void AalTextureBufferPixelReadMapper::deleteConversionTarget(QOpenGLFunctions* gl)
+{
+    if (m_conversionFbo) {
+        gl->glDeleteFramebuffers(1, &m_conversionFbo);
+    }
+    if (m_conversionTexture) {
+        gl->glDeleteTextures(1, &m_conversionTexture);
+    }
+    m_conversionFbo = 0;
+    m_conversionTexture = 0;
+    m_conversionSize = QSize();
+}
+
+void AalTextureBufferPixelReadMapper::deletePixelPackBuffers(QOpenGLFunctions* gl)
+{
+    if (m_pbos[0]) {
+        gl->glDeleteBuffers(PboRingSize, m_pbos);
+    }
+    for (int i = 0; i < PboRingSize; i++) {
+        m_pbos[i] = 0;
+    }
+    m_pboSize = QSize();
+    m_pboIndex = 0;
+    m_pboPending = false;
+}
+
+static QString calibrationCacheFile()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) +
+            QStringLiteral("/qtubuntu-camera/mappers.conf");
+}
+
+/*!
+ * \brief The MapperCalibration class holds the mapper verdicts of the process,
+ * and the calibrations in progress, so that every viewfinder output and video
+ * prober shares them
+ */
+class MapperCalibration
+{
+public:
+    static MapperCalibration& instance()
+    {
+        static MapperCalibration calibration;
+        return calibration;
+    }
+
+    // Name of the mapper chosen for the key, empty if there is no verdict yet
+    QString verdict(const QString &driverKey, const QString &key)
+    {
+        QMutexLocker locker(&m_mutex);
+        const QString cacheKey = driverKey + '/' + key;
+        QHash<QString, QString>::const_iterator it = m_verdicts.constFind(cacheKey);
+        if (it != m_verdicts.constEnd()) {
+            return it.value();
+        }
+
+        QSettings settings(calibrationCacheFile(), QSettings::IniFormat);
+        settings.beginGroup(driverKey);
+        const QString name = settings.value(key).toString();
+        m_verdicts.insert(cacheKey, name);
+        return name;
+    }
+
+    // Returns true if no other mapper is calibrating for the key
+    bool claim(const QString &driverKey, const QString &key)
+    {
+        QMutexLocker locker(&m_mutex);
+        const QString cacheKey = driverKey + '/' + key;
+        if (m_claimed.contains(cacheKey)) {
+            return false;
+        }
+        m_claimed.insert(cacheKey);
+        return true;
+    }
+
+    // Releases the claim, and persists the verdict unless it is empty
+    void finish(const QString &driverKey, const QString &key, const QString &name)
+    {
+        QMutexLocker locker(&m_mutex);
+        const QString cacheKey = driverKey + '/' + key;
+        m_claimed.remove(cacheKey);
+        if (name.isEmpty()) {
+            return;
+        }
+
+        m_verdicts.insert(cacheKey, name);
+        QSettings settings(calibrationCacheFile(), QSettings::IniFormat);
+        settings.beginGroup(driverKey);
+        settings.setValue(key, name);
+    }
+
+private:
+    QMutex m_mutex;
+    QHash<QString, QString> m_verdicts;
+    QSet<QString> m_claimed;
+};
+
+static bool isUniform(const std::vector<uchar> &pixels)
+{
+    return std::all_of(pixels.begin(), pixels.end(),
+                       [&pixels](uchar value) { return value == pixels[0]; });
+}
+
+AalTextureBufferCalibratingMapper::AalTextureBufferCalibratingMapper() :
+    AalTextureBufferMapper(),
+    m_mapped(nullptr),
+    m_calibrationStep(0),
+    m_calibrationRetry(0)
+{
+    // The glReadPixels() mapper comes first: it maps the frames until there
+    // is a verdict, and the other candidates are checked against its output
+    Candidate pixelRead;
+    pixelRead.name = QStringLiteral("pixelread");
+    pixelRead.mapper.reset(new AalTextureBufferPixelReadMapper());
+    m_candidates.push_back(std::move(pixelRead));
+
+    Candidate graphic;
+    graphic.name = QStringLiteral("graphic");
+    graphic.mapper.reset(new AalTextureBufferGraphicMapper());
+    m_candidates.push_back(std::move(graphic));
+
+    for (Candidate &candidate : m_candidates) {
+        candidate.correct = false;
+        candidate.time = 0;
+    }
+}
+
+AalTextureBufferCalibratingMapper::~AalTextureBufferCalibratingMapper()
+{
+    // Let another mapper calibrate instead
+    if (!m_calibrationKey.isEmpty()) {
+        MapperCalibration::instance().finish(m_driverKey, m_calibrationKey, QString());
+    }
+}
+
+uchar* AalTextureBufferCalibratingMapper::map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine)
+{
+    // Already mapped? Let the mapper in use return the address then
+    if (m_mapped) {
+        return m_mapped->map(mode, numBytes, bytesPerLine);
+    }
+
+    m_mapStatus = MapFailed;
+
+    if (m_width <= 0 || m_height <= 0) {
+        qWarning() << "Tried to map buffer of invalid dimensions, cannot map memory.";
+        return nullptr;
+    }
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if (!context) {
+        qWarning() << "OpenGL context is not current, cannot map memory.";
+        return nullptr;
+    }
+
+    if (m_driverKey.isEmpty()) {
+        char device[PROP_VALUE_MAX];
+        property_get("ro.product.device", device, "");
+
+        QOpenGLFunctions* gl = context->functions();
+        const QByteArray driver = QByteArray(device) + '|' +
+                QByteArray((const char*)gl->glGetString(GL_RENDERER)) + '|' +
+                QByteArray((const char*)gl->glGetString(GL_VERSION));
+        m_driverKey = QString::fromLatin1(QCryptographicHash::hash(driver, QCryptographicHash::Md5).toHex());
+    }
+
+    const QString key = verdictKey();
+    const int index = verdictFor(key);
+    if (index < 0 && m_calibrationKey.isEmpty()) {
+        if (m_calibrationRetry > 0) {
+            m_calibrationRetry--;
+        } else if (MapperCalibration::instance().claim(m_driverKey, key)) {
+            m_calibrationKey = key;
+            m_calibrationStep = 0;
+        }
+    }
+
+    // Frames without a verdict are mapped with glReadPixels()
+    AalTextureBufferMapper* mapper = m_candidates[index < 0 ? 0 : index].mapper.get();
+    configure(mapper, m_readbackMode);
+    uchar* bits = mapper->map(mode, numBytes, bytesPerLine);
+    m_mapStatus = mapper->mapStatus();
+    if (bits) {
+        m_mapped = mapper;
+        m_mapMode = mode;
+    }
+    return bits;
+}
+
+void AalTextureBufferCalibratingMapper::unmap()
+{
+    if (!m_mapped) {
+        return;
+    }
+
+    m_mapped->unmap();
+    m_mapped = nullptr;
+    m_mapMode = QAbstractVideoBuffer::NotMapped;
+
+    // The frame is handed over, calibrate on it now
+    if (!m_calibrationKey.isEmpty()) {
+        calibrationStep();
+    }
+}
+
+void AalTextureBufferCalibratingMapper::configure(AalTextureBufferMapper* mapper,
+                                                  AalVideoRendererControl::ReadbackMode mode) const
+{
+    mapper->setTextureId(m_textureId);
+    mapper->setSize(m_textureSize);
+    mapper->setOutput(QSize(m_width, m_height), m_cropRect);
+    mapper->setReadbackMode(mode);
+    mapper->setPixelFormat(m_pixelFormat);
+    mapper->setFrameSequence(m_frameSequence);
+}
+
+QString AalTextureBufferCalibratingMapper::verdictKey() const
+{
+    // Scaled outputs take another path through the candidates than whole textures
+    return QString("%1x%2-%3x%4-%5").arg(m_textureSize.width()).arg(m_textureSize.height())
+            .arg(m_width).arg(m_height).arg(m_pixelFormat);
+}
+
+/*!
+ * \brief AalTextureBufferCalibratingMapper::verdictFor looks up the verdict
+ * for a key, in this mapper and then in the ones shared by the process
+ * \return the index of the candidate to use, or -1 without a verdict
+ */
+int AalTextureBufferCalibratingMapper::verdictFor(const QString &key)
+{
+    int index = m_verdicts.value(key, -1);
+    if (index >= 0) {
+        return index;
+    }
+
+    const QString name = MapperCalibration::instance().verdict(m_driverKey, key);
+    if (name.isEmpty()) {
+        return -1;
+    }
+    for (int i = 0; i < int(m_candidates.size()); i++) {
+        if (m_candidates[i].name == name) {
+            index = i;
+        }
+    }
+    if (index >= 0) {
+        m_verdicts.insert(key, index);
+    }
+    return index;
+}
+
+/*!
+ * \brief AalTextureBufferCalibratingMapper::calibrationStep makes one step of
+ * the calibration on the current frame
+ * Every candidate is first checked against the glReadPixels() output of the
+ * same frame, then timed over CalibrationRuns frames. Each step maps at most
+ * twice, so that no frame is held up for the whole calibration.
+ */
+void AalTextureBufferCalibratingMapper::calibrationStep()
+{
+    if (verdictKey() != m_calibrationKey) {
+        // The output changed under the calibration, start over for the new one
+        finishCalibration(-1);
+        m_calibrationRetry = 0;
+        return;
+    }
+
+    if (!QOpenGLContext::currentContext()) {
+        return;
+    }
+
+    const int stepsPerCandidate = 1 + CalibrationRuns;
+    Candidate &candidate = m_candidates[m_calibrationStep / stepsPerCandidate];
+    const int run = m_calibrationStep % stepsPerCandidate;
+
+    if (run == 0) {
+        const std::vector<uchar> reference = readBack(m_candidates[0].mapper.get());
+        if (reference.empty()) {
+            finishCalibration(-1);
+            return;
+        }
+
+        // A black or covered viewfinder would let a broken mapper pass the check
+        if (isUniform(reference)) {
+            qDebug() << "Viewfinder frame is uniform, postponing mapper calibration";
+            finishCalibration(-1);
+            return;
+        }
+
+        // The first map also allocates the candidate's buffers, keep it out
+        // of the timing
+        candidate.correct = true;
+        candidate.time = 0;
+        if (&candidate != &m_candidates[0]) {
+            const std::vector<uchar> pixels = readBack(candidate.mapper.get());
+
+            // Allow for rounding differences between the paths
+            size_t mismatches = 0;
+            candidate.correct = pixels.size() == reference.size();
+            for (size_t i = 0; candidate.correct && i < pixels.size(); i++) {
+                if (std::abs(int(pixels[i]) - int(reference[i])) > 2) {
+                    mismatches++;
+                }
+            }
+            candidate.correct = candidate.correct && mismatches <= pixels.size() / 100;
+        }
+    } else if (candidate.correct) {
+        QElapsedTimer timer;
+        timer.start();
+        if (readBack(candidate.mapper.get()).empty()) {
+            candidate.correct = false;
+        } else {
+            candidate.time += timer.nsecsElapsed();
+        }
+    }
+
+    m_calibrationStep++;
+    if (m_calibrationStep < int(m_candidates.size()) * stepsPerCandidate) {
+        return;
+    }
+
+    int best = -1;
+    qint64 bestTime = std::numeric_limits<qint64>::max();
+    for (int i = 0; i < int(m_candidates.size()); i++) {
+        const qint64 time = m_candidates[i].time / CalibrationRuns;
+        qDebug() << "Mapper" << m_candidates[i].name << "maps a frame in" << time / 1000 << "us"
+                 << (m_candidates[i].correct ? "" : "with an incorrect output");
+        if (m_candidates[i].correct && time < bestTime) {
+            best = i;
+            bestTime = time;
+        }
+    }
+    finishCalibration(best);
+}
+
+/*!
+ * \brief AalTextureBufferCalibratingMapper::finishCalibration shares the
+ * verdict of the calibration, and releases it
+ * \param verdict index of the chosen candidate, or -1 to try again later
+ * rather than persisting a guess
+ */
+void AalTextureBufferCalibratingMapper::finishCalibration(int verdict)
+{
+    QString name;
+    if (verdict >= 0) {
+        name = m_candidates[verdict].name;
+        qDebug() << "Calibrated viewfinder mapper for" << m_calibrationKey << ":" << name;
+        m_verdicts.insert(m_calibrationKey, verdict);
+    } else {
+        m_calibrationRetry = CalibrationRetryFrames;
+    }
+
+    MapperCalibration::instance().finish(m_driverKey, m_calibrationKey, name);
+    m_calibrationKey.clear();
+}
+
+/*!
+ * \brief AalTextureBufferCalibratingMapper::readBack maps the current frame
+ * with a mapper and copies its rows out, without the mapper's row padding
+ */
+std::vector<uchar> AalTextureBufferCalibratingMapper::readBack(AalTextureBufferMapper* mapper)
+{
+    std::vector<uchar> pixels;
+
+    configure(mapper, AalVideoRendererControl::ExactReadback);
+    int numBytes = 0;
+    int bytesPerLine = 0;
+    const uchar* bits = mapper->map(QAbstractVideoBuffer::ReadOnly, &numBytes, &bytesPerLine);
+    if (!bits) {
+        return pixels;
+    }
+
+    const QSize size = targetSize();
+    const int rowBytes = size.width() * 4;
+    pixels.resize(size_t(rowBytes) * size.height());
+    for (int y = 0; y < size.height(); y++) {
+        memcpy(pixels.data() + size_t(y) * rowBytes, bits + size_t(y) * bytesPerLine, rowBytes);
+    }
+    mapper->unmap();
+    return pixels;
+}
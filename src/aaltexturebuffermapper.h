@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AALTEXTUREBUFFERMAPPER_H
+#define AALTEXTUREBUFFERMAPPER_H
+
+#include "aalvideorenderercontrol.h"
+
+#include <QAbstractVideoBuffer>
+#include <QHash>
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLVertexArrayObject>
+#include <QPointer>
+#include <QRectF>
+#include <QSize>
+#include <QString>
+#include <QVector4D>
+#include <QVideoFrame>
+#include <qopengl.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <memory>
+#include <vector>
+
+class QOpenGLExtraFunctions;
+class QOpenGLFunctions;
+class QOpenGLShaderProgram;
+struct graphic_buffer;
+
+/*!
+ * \brief The AalTextureBufferMapper class reads the viewfinder texture back
+ * into memory, so that a QVideoFrame can be mapped by the CPU
+ */
+class AalTextureBufferMapper
+{
+public:
+    // Outcome of the last map(), which returns nullptr unless MapOk
+    enum MapStatus {
+        MapOk,
+        MapNotReady,   // NonBlockingReadback copy still in flight, try again
+        MapFailed
+    };
+
+    AalTextureBufferMapper();
+    virtual ~AalTextureBufferMapper();
+
+    void setTextureId(GLuint textureId) { m_textureId = textureId; }
+    // Size of the viewfinder texture, which is read back whole by default
+    void setSize(const QSize& size)
+    {
+        m_textureSize = size;
+        m_width = size.width();
+        m_height = size.height();
+        m_cropRect = QRectF(0, 0, 1, 1);
+    }
+    // Renders the normalized crop rectangle of the frame to a buffer of the
+    // given size, instead of reading the whole frame back at full resolution
+    void setOutput(const QSize& size, const QRectF& cropRect)
+    {
+        m_width = size.width();
+        m_height = size.height();
+        m_cropRect = cropRect;
+    }
+    void setReadbackMode(AalVideoRendererControl::ReadbackMode mode) { m_readbackMode = mode; }
+    // Sequence number of the viewfinder frame the texture currently holds
+    void setFrameSequence(qint64 sequence) { m_frameSequence = sequence; }
+    void setPixelFormat(QVideoFrame::PixelFormat format) { m_pixelFormat = format; }
+
+    static bool isPixelFormatSupported(QVideoFrame::PixelFormat format, const QSize &size);
+    static void warmUpShaders();
+
+    QAbstractVideoBuffer::MapMode mapMode() const { return m_mapMode; }
+    MapStatus mapStatus() const { return m_mapStatus; }
+    virtual uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) = 0;
+    virtual void unmap() = 0;
+
+    int planes(uchar* bits, int bytesPerLine, int planeBytesPerLine[4], uchar* planeData[4]) const;
+
+protected:
+    QSize targetSize() const;
+    bool isCropped() const { return m_cropRect != QRectF(0, 0, 1, 1); }
+    // True if the output is the whole texture at its own size
+    bool isWholeTexture() const
+    {
+        return !isCropped() && QSize(m_width, m_height) == m_textureSize;
+    }
+    bool renderWithShader(QOpenGLFunctions* gl, QVideoFrame::PixelFormat format);
+
+    GLuint m_textureId;
+    QSize m_textureSize;
+    int m_width;
+    int m_height;
+    QRectF m_cropRect;
+    QAbstractVideoBuffer::MapMode m_mapMode;
+    MapStatus m_mapStatus;
+    AalVideoRendererControl::ReadbackMode m_readbackMode;
+    QVideoFrame::PixelFormat m_pixelFormat;
+    qint64 m_frameSequence;
+
+private:
+    // Copy program of a pixel format, with its uniform locations and the
+    // values last set to them
+    struct CopyProgram {
+        CopyProgram();
+
+        std::shared_ptr<QOpenGLShaderProgram> program;
+        int cropLocation;
+        int frameSizeLocation;
+        QVector4D crop;
+        QSizeF frameSize;
+    };
+
+    static const int CopyTextureUnit = 1;
+    static const GLuint VertexCoordLocation = 0;
+    static const GLuint TextureCoordLocation = 1;
+
+    bool createQuad();
+    void bindQuadAttributes(QOpenGLFunctions* gl);
+    CopyProgram* copyProgram(QVideoFrame::PixelFormat format);
+    void releaseCopyPass();
+    std::shared_ptr<QOpenGLShaderProgram> compileShaders(QVideoFrame::PixelFormat format);
+
+    QPointer<QOpenGLContext> m_copyContext;
+    QOpenGLBuffer m_quadBuffer;
+    QOpenGLVertexArrayObject m_vao;
+    QHash<int, CopyProgram> m_programs;
+};
+
+/*!
+ * \brief The AalTextureBufferGraphicMapper class copies the viewfinder texture
+ * into a GraphicBuffer through an EGLImage, and maps the GraphicBuffer memory
+ */
+class AalTextureBufferGraphicMapper : public AalTextureBufferMapper
+{
+public:
+    AalTextureBufferGraphicMapper();
+    ~AalTextureBufferGraphicMapper();
+
+    uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) override;
+    void unmap() override;
+
+private:
+    // GraphicBuffer, with the EGLImage, texture and FBO used to render into it
+    struct Slot {
+        Slot();
+
+        struct graphic_buffer* graphicBuffer;
+        EGLImageKHR eglImage;
+        EGLDisplay eglDisplay;
+        EGLSyncKHR fence;
+        qint64 sequence;  // frame copied into the slot
+        GLuint texture;
+        GLuint fbo;
+        void* vramAddr;
+        QSize size;
+    };
+
+    // Number of slots kept alive, so that mapping a frame reuses already
+    // allocated buffers instead of creating new ones every time.
+    static const int RingSize = 3;
+
+    bool createSlot(QOpenGLFunctions* gl, Slot &slot, const QSize &size);
+    void destroySlot(Slot &slot);
+    bool insertFence(Slot &slot);
+    bool waitForFence(QOpenGLFunctions* gl, Slot &slot);
+
+    Slot m_slots[RingSize];
+    int m_current;
+    int m_next;
+    EGLDisplay m_fenceDisplay;
+    EGLenum m_fenceType;
+
+    PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
+    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+    PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+    PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+    PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+};
+
+/*!
+ * \brief The AalTextureBufferPixelReadMapper class reads the viewfinder
+ * texture back with glReadPixels()
+ */
+class AalTextureBufferPixelReadMapper : public AalTextureBufferMapper
+{
+public:
+    AalTextureBufferPixelReadMapper();
+    ~AalTextureBufferPixelReadMapper();
+
+    uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) override;
+    void unmap() override;
+
+private:
+    // Number of pixel pack buffers used in LatestReadback mode: one receives
+    // the current frame while the other one, filled on the previous map(),
+    // is read by the CPU.
+    static const int PboRingSize = 2;
+
+    static bool hasPixelPackBuffers(QOpenGLContext* context);
+    bool bindReadFramebuffer(QOpenGLFunctions* gl, const QSize &size);
+    void readLatest(QOpenGLFunctions* gl, QOpenGLExtraFunctions* extra, const QSize &size);
+    void deleteConversionTarget(QOpenGLFunctions* gl);
+    void deletePixelPackBuffers(QOpenGLFunctions* gl);
+
+    std::vector<uchar> m_pixelBuffer;
+    GLuint m_fbo;
+    GLuint m_conversionFbo;
+    GLuint m_conversionTexture;
+    QSize m_conversionSize;
+    GLuint m_pbos[PboRingSize];
+    QSize m_pboSize;
+    int m_pboIndex;
+    bool m_pboPending;
+    qint64 m_pboSequence;
+};
+
+/*!
+ * \brief The AalTextureBufferCalibratingMapper class picks the fastest mapper
+ * that reads the viewfinder back correctly
+ * Frames of a size and format without a verdict are mapped with the
+ * glReadPixels() mapper, while one mapper in the process times every
+ * candidate against it, one step per frame after the frame is unmapped. The
+ * verdict is shared by all the mappers in the process, and kept in a cache
+ * keyed by device and GL driver, so that it is only measured once.
+ */
+class AalTextureBufferCalibratingMapper : public AalTextureBufferMapper
+{
+public:
+    AalTextureBufferCalibratingMapper();
+    ~AalTextureBufferCalibratingMapper();
+
+    uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) override;
+    void unmap() override;
+
+private:
+    struct Candidate {
+        QString name;
+        std::unique_ptr<AalTextureBufferMapper> mapper;
+        bool correct;
+        qint64 time;
+    };
+
+    // Number of timed maps per candidate, after a first untimed one that
+    // allocates the candidate's buffers and checks its output
+    static const int CalibrationRuns = 3;
+    // Frames to wait before calibrating again after a frame that does not
+    // allow telling correct outputs apart
+    static const int CalibrationRetryFrames = 30;
+
+    void configure(AalTextureBufferMapper* mapper, AalVideoRendererControl::ReadbackMode mode) const;
+    QString verdictKey() const;
+    int verdictFor(const QString &key);
+    void calibrationStep();
+    void finishCalibration(int verdict);
+    std::vector<uchar> readBack(AalTextureBufferMapper* mapper);
+
+    std::vector<Candidate> m_candidates;
+    QString m_driverKey;
+    QHash<QString, int> m_verdicts;
+    AalTextureBufferMapper* m_mapped;
+
+    // Calibration this mapper has claimed, progressing by one step per frame
+    QString m_calibrationKey;
+    int m_calibrationStep;
+    int m_calibrationRetry;
+};
+
+#endif // AALTEXTUREBUFFERMAPPER_H
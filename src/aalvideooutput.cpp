@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aalvideooutput.h"
+#include "aalframestatistics.h"
+#include "aaltexturebuffermapper.h"
+
+#include <QAbstractVideoBuffer>
+#include <QDebug>
+#include <QVideoSurfaceFormat>
+
+#include <hybris/common/dlfcn.h>
+
+#include <cstring>
+#include <dlfcn.h>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class AalGLTextureBuffer : public QAbstractVideoBuffer
+{
+public:
+    AalGLTextureBuffer(GLuint textureId, const std::shared_ptr<AalTextureBufferMapper>& mapper,
+                       AalFrameStatistics* statistics) :
+        QAbstractVideoBuffer(QAbstractVideoBuffer::GLTextureHandle),
+        m_textureId(textureId),
+        m_mapper(mapper),
+        m_statistics(statistics)
+    {
+    }
+
+    ~AalGLTextureBuffer()
+    {
+    }
+
+    MapMode mapMode() const
+    {
+        if (!m_mapper)
+            return QAbstractVideoBuffer::NotMapped;
+        return m_mapper->mapMode();
+    }
+
+    uchar *map(MapMode mode, int *numBytes, int *bytesPerLine)
+    {
+        if (!m_mapper)
+            return nullptr;
+        return timedMap(mode, numBytes, bytesPerLine);
+    }
+
+    int mapPlanes(MapMode mode, int *numBytes, int bytesPerLine[4], uchar *data[4])
+    {
+        if (!m_mapper)
+            return 0;
+
+        int stride = 0;
+        uchar *bits = timedMap(mode, numBytes, &stride);
+        if (!bits)
+            return 0;
+        return m_mapper->planes(bits, stride, bytesPerLine, data);
+    }
+
+    void unmap()
+    {
+        if (!m_mapper)
+            return;
+        m_mapper->unmap();
+    }
+
+    QVariant handle() const
+    {
+        return QVariant::fromValue<unsigned int>(m_textureId);
+    }
+
+    GLuint textureId() { return m_textureId; }
+
+    // Tells a failed map from a NonBlockingReadback copy still in flight
+    AalTextureBufferMapper::MapStatus mapStatus() const
+    {
+        if (!m_mapper)
+            return AalTextureBufferMapper::MapFailed;
+        return m_mapper->mapStatus();
+    }
+
+private:
+    uchar *timedMap(MapMode mode, int *numBytes, int *bytesPerLine)
+    {
+        const qint64 start = CameraChannel::monotonicTime();
+        uchar *bits = m_mapper->map(mode, numBytes, bytesPerLine);
+        if (bits && m_statistics)
+            m_statistics->addSample(AalFrameStatistics::MapDuration,
+                                    CameraChannel::monotonicTime() - start);
+        return bits;
+    }
+
+    GLuint m_textureId;
+    std::shared_ptr<AalTextureBufferMapper> m_mapper;
+    AalFrameStatistics* m_statistics;
+};
+
+static bool fileExists(const std::string& filename) {
+    struct stat buffer;
+    return (stat(filename.c_str(), &buffer) == 0);
+}
+
+AalVideoOutput::AalVideoOutput(QAbstractVideoSurface *surface, AalFrameStatistics *statistics) :
+    m_surface(surface),
+    m_statistics(statistics),
+    m_mapper(createMapper()),
+    m_readbackMode(AalVideoRendererControl::ExactReadback),
+    m_pixelFormat(QVideoFrame::Format_RGB32),
+    m_maxFrameRate(0),
+    m_lastPresentTime(0),
+    m_hasPendingReadback(false)
+{
+}
+
+AalVideoOutput::~AalVideoOutput()
+{
+}
+
+AalTextureBufferMapper *AalVideoOutput::createMapper()
+{
+#ifdef __LP64__
+    static const char* ldpath = "/system/lib64/libui_compat_layer.so";
+#else
+    static const char* ldpath = "/system/lib/libui_compat_layer.so";
+#endif
+    void* handle = hybris_dlopen(ldpath, RTLD_LAZY);
+
+    bool useGlReadPixels = fileExists("/usr/lib/droidian/device/aal-glreadpixels");
+
+    if (!handle || useGlReadPixels) {
+        qDebug() << "AalTextureBufferPixelReadMapper";
+        return new AalTextureBufferPixelReadMapper();
+    }
+
+    // Time the GraphicBuffer path against glReadPixels() on first use
+    qDebug() << "AalTextureBufferCalibratingMapper";
+    hybris_dlclose(handle);
+    return new AalTextureBufferCalibratingMapper();
+}
+
+void AalVideoOutput::setReadbackMode(AalVideoRendererControl::ReadbackMode mode)
+{
+    m_readbackMode = mode;
+}
+
+/*!
+ * \brief AalVideoOutput::present presents a viewfinder frame to the surface,
+ * unless that exceeds the surface's frame rate cap
+ * \return true if the frame was presented
+ */
+bool AalVideoOutput::present(const Frame &frame)
+{
+    if (!m_surface) {
+        return false;
+    }
+
+    if (!isFrameDue(frame.presentTime)) {
+        return false;
+    }
+
+    QRect cropRect;
+    QSize frameSize;
+    if (!outputGeometry(frame.size, &cropRect, &frameSize)) {
+        return false;
+    }
+
+    // Renegotiate the surface format if the analysis size changed
+    if (m_surface->isActive() && m_surface->surfaceFormat().frameSize() != frameSize) {
+        m_surface->stop();
+    }
+
+    if (!m_surface->isActive()) {
+        m_pixelFormat = choosePixelFormat(frameSize, QAbstractVideoBuffer::GLTextureHandle);
+    }
+    configureMapper(frame, cropRect, frameSize, m_pixelFormat, m_readbackMode);
+    QVideoFrame videoFrame(new AalGLTextureBuffer(frame.textureId, m_mapper, m_statistics),
+                           frameSize, m_pixelFormat);
+
+    if (!videoFrame.isValid()) {
+        qWarning() << "Invalid frame";
+        return false;
+    }
+
+    videoFrame.setMetaData("CamControl", QVariant::fromValue((void*)frame.control));
+    if (frame.channel) {
+        videoFrame.setMetaData("CameraChannel", QVariant::fromValue(frame.channel));
+    }
+    videoFrame.setMetaData("CropRect", cropRect);
+    videoFrame.setMetaData("SequenceNumber", frame.sequence);
+    videoFrame.setMetaData("PresentTime", frame.presentTime);
+    videoFrame.setStartTime(frame.time);
+
+    if (!m_surface->isActive()) {
+        QVideoSurfaceFormat format(videoFrame.size(), videoFrame.pixelFormat(), videoFrame.handleType());
+
+        if (!m_surface->start(format)) {
+            qWarning() << "Failed to start viewfinder with format:" << format;
+        }
+    }
+
+    if (!m_surface->isActive()) {
+        return false;
+    }
+
+    m_surface->present(videoFrame);
+    m_lastPresentTime = frame.presentTime;
+    return true;
+}
+
+/*!
+ * \brief AalVideoOutput::queueLatched remembers a viewfinder frame, to be
+ * read back once the render thread has latched it, unless that exceeds the
+ * surface's frame rate cap. A frame still waiting for that is dropped.
+ */
+void AalVideoOutput::queueLatched(const Frame &frame)
+{
+    if (!m_surface || !isFrameDue(frame.presentTime)) {
+        return;
+    }
+
+    Readback readback;
+    readback.frame = frame;
+    if (!outputGeometry(frame.size, &readback.cropRect, &readback.size)) {
+        return;
+    }
+
+    if (!m_surface->isActive() || m_surface->surfaceFormat().frameSize() != readback.size ||
+        !AalTextureBufferMapper::isPixelFormatSupported(m_pixelFormat, readback.size)) {
+        m_pixelFormat = choosePixelFormat(readback.size, QAbstractVideoBuffer::NoHandle);
+    }
+    readback.pixelFormat = m_pixelFormat;
+    readback.mode = m_readbackMode;
+
+    QMutexLocker locker(&m_latchMutex);
+    m_pendingReadback = readback;
+    m_hasPendingReadback = true;
+}
+
+/*!
+ * \brief AalVideoOutput::mapLatched reads back the frame waiting for the
+ * given sequence number, or an earlier one, into a frame in memory
+ * Called on the render thread after it latched the frame, with its context
+ * current. The frame is kept for presentLatched().
+ * \return true if a frame was read back
+ */
+bool AalVideoOutput::mapLatched(qint64 sequence)
+{
+    Readback readback;
+    {
+        QMutexLocker locker(&m_latchMutex);
+        if (!m_hasPendingReadback || m_pendingReadback.frame.sequence > sequence) {
+            return false;
+        }
+        readback = m_pendingReadback;
+        m_hasPendingReadback = false;
+    }
+
+    configureMapper(readback.frame, readback.cropRect, readback.size, readback.pixelFormat,
+                    readback.mode);
+
+    int numBytes = 0;
+    int bytesPerLine = 0;
+    const qint64 start = CameraChannel::monotonicTime();
+    const uchar *bits = m_mapper->map(QAbstractVideoBuffer::ReadOnly, &numBytes, &bytesPerLine);
+    if (!bits) {
+        return false;
+    }
+    if (m_statistics) {
+        m_statistics->addSample(AalFrameStatistics::MapDuration,
+                                CameraChannel::monotonicTime() - start);
+    }
+
+    QVideoFrame latched(numBytes, readback.size, bytesPerLine, readback.pixelFormat);
+    if (latched.map(QAbstractVideoBuffer::WriteOnly)) {
+        if (readback.pixelFormat == QVideoFrame::Format_YUV420P) {
+            // U and V rows are read back side by side, frames in memory
+            // hold one plane after the other
+            const int height = readback.size.height();
+            const int chromaWidth = readback.size.width() / 2;
+            memcpy(latched.bits(0), bits, bytesPerLine * height);
+            const uchar *chroma = bits + bytesPerLine * height;
+            for (int y = 0; y < height / 2; y++) {
+                memcpy(latched.bits(1) + y * latched.bytesPerLine(1), chroma, chromaWidth);
+                memcpy(latched.bits(2) + y * latched.bytesPerLine(2), chroma + chromaWidth, chromaWidth);
+                chroma += bytesPerLine;
+            }
+        } else {
+            memcpy(latched.bits(), bits, numBytes);
+        }
+        latched.unmap();
+    }
+    m_mapper->unmap();
+
+    latched.setMetaData("CropRect", readback.cropRect);
+    latched.setMetaData("SequenceNumber", readback.frame.sequence);
+    latched.setMetaData("PresentTime", readback.frame.presentTime);
+    latched.setStartTime(readback.frame.time);
+
+    QMutexLocker locker(&m_latchMutex);
+    m_latchedFrame = latched;
+    return true;
+}
+
+/*!
+ * \brief AalVideoOutput::presentLatched presents the frame read back last by
+ * mapLatched(), if any
+ * \return true if the frame was presented
+ */
+bool AalVideoOutput::presentLatched()
+{
+    QVideoFrame frame;
+    {
+        QMutexLocker locker(&m_latchMutex);
+        frame = m_latchedFrame;
+        m_latchedFrame = QVideoFrame();
+    }
+
+    if (!frame.isValid()) {
+        return false;
+    }
+    return presentMemoryFrame(frame);
+}
+
+/*!
+ * \brief AalVideoOutput::acceptsMemoryFrames returns true if the surface takes
+ * NV21 frames in memory, as delivered by the HAL preview callback
+ */
+bool AalVideoOutput::acceptsMemoryFrames() const
+{
+    return m_surface &&
+        m_surface->supportedPixelFormats(QAbstractVideoBuffer::NoHandle).contains(QVideoFrame::Format_NV21);
+}
+
+/*!
+ * \brief AalVideoOutput::presentMemoryFrame presents a preview callback frame
+ * to the surface, unless that exceeds the surface's frame rate cap
+ * These frames are already in memory, the analysis size and crop rectangle
+ * do not apply to them.
+ * \return true if the frame was presented
+ */
+bool AalVideoOutput::presentMemoryFrame(const QVideoFrame &frame)
+{
+    if (!m_surface) {
+        return false;
+    }
+
+    // Frames read back from the viewfinder carry the time they were presented
+    const QVariant presentTimeData = frame.metaData("PresentTime");
+    const qint64 presentTime = presentTimeData.isValid() ? presentTimeData.toLongLong()
+                                                         : frame.startTime();
+    if (!isFrameDue(presentTime)) {
+        return false;
+    }
+
+    const QVideoSurfaceFormat format(frame.size(), frame.pixelFormat(), frame.handleType());
+    if (m_surface->isActive() && m_surface->surfaceFormat() != format) {
+        m_surface->stop();
+    }
+
+    if (!m_surface->isActive() && !m_surface->start(format)) {
+        qWarning() << "Failed to start viewfinder with format:" << format;
+        return false;
+    }
+
+    m_surface->present(frame);
+    m_lastPresentTime = presentTime;
+    return true;
+}
+
+void AalVideoOutput::stop()
+{
+    if (m_surface && m_surface->isActive()) {
+        m_surface->stop();
+    }
+    m_lastPresentTime = 0;
+
+    QMutexLocker locker(&m_latchMutex);
+    m_hasPendingReadback = false;
+    m_latchedFrame = QVideoFrame();
+}
+
+bool AalVideoOutput::isFrameDue(qint64 presentTime) const
+{
+    if (m_maxFrameRate <= 0 || !m_lastPresentTime) {
+        return true;
+    }
+
+    // Leave some slack, so that jitter does not make a 15 fps cap on a
+    // 30 fps viewfinder drop to 10 fps
+    const qint64 interval = qint64(1000000 / m_maxFrameRate);
+    return presentTime - m_lastPresentTime >= interval * 9 / 10;
+}
+
+/*!
+ * \brief AalVideoOutput::outputGeometry computes the rectangle of the
+ * viewfinder that frames cover, and the size they are mapped at
+ * Frames are mapped at the analysis size, if any, and cover the analysis
+ * crop rectangle only.
+ * \return false if frames would be empty
+ */
+bool AalVideoOutput::outputGeometry(const QSize &vfSize, QRect *cropRect, QSize *frameSize) const
+{
+    const QRect frameRect(QPoint(0, 0), vfSize);
+
+    *cropRect = frameRect;
+    if (m_analysisCrop.isValid()) {
+        *cropRect = m_analysisCrop.intersected(frameRect);
+    }
+    *frameSize = cropRect->size();
+    if (m_analysisSize.isValid()) {
+        *frameSize = m_analysisSize;
+    }
+    if (frameSize->isEmpty()) {
+        qWarning() << "Can't draw video frame with an empty analysis crop rectangle";
+        return false;
+    }
+    return true;
+}
+
+// Only called on the thread mapping the output's frames
+void AalVideoOutput::configureMapper(const Frame &frame, const QRect &cropRect,
+                                     const QSize &frameSize, QVideoFrame::PixelFormat pixelFormat,
+                                     AalVideoRendererControl::ReadbackMode mode)
+{
+    const QSize vfSize = frame.size;
+
+    m_mapper->setTextureId(frame.textureId);
+    m_mapper->setFrameSequence(frame.sequence);
+    m_mapper->setSize(vfSize);
+    if (cropRect != QRect(QPoint(0, 0), vfSize) || frameSize != vfSize) {
+        m_mapper->setOutput(frameSize, QRectF((qreal)cropRect.x() / vfSize.width(),
+                                              (qreal)cropRect.y() / vfSize.height(),
+                                              (qreal)cropRect.width() / vfSize.width(),
+                                              (qreal)cropRect.height() / vfSize.height()));
+    }
+    m_mapper->setPixelFormat(pixelFormat);
+    m_mapper->setReadbackMode(mode);
+}
+
+/*!
+ * \brief AalVideoOutput::choosePixelFormat picks the pixel format frames are
+ * presented with
+ * Frames are RGB32 unless the surface prefers NV12 or YUV420P, in which case
+ * mapping a frame converts it on the GPU before reading it back.
+ */
+QVideoFrame::PixelFormat AalVideoOutput::choosePixelFormat(const QSize &size,
+                                                           QAbstractVideoBuffer::HandleType handleType) const
+{
+    const QList<QVideoFrame::PixelFormat> formats = m_surface->supportedPixelFormats(handleType);
+
+    Q_FOREACH(QVideoFrame::PixelFormat format, formats) {
+        if (format != QVideoFrame::Format_RGB32 &&
+            format != QVideoFrame::Format_NV12 &&
+            format != QVideoFrame::Format_YUV420P) {
+            continue;
+        }
+        if (AalTextureBufferMapper::isPixelFormatSupported(format, size)) {
+            return format;
+        }
+    }
+
+    return QVideoFrame::Format_RGB32;
+}
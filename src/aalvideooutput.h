@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AALVIDEOOUTPUT_H
+#define AALVIDEOOUTPUT_H
+
+#include "aalvideorenderercontrol.h"
+#include "camera_channel.h"
+
+#include <QAbstractVideoSurface>
+#include <QMutex>
+#include <QPointer>
+#include <QRect>
+#include <QSize>
+#include <QVideoFrame>
+#include <qopengl.h>
+
+#include <memory>
+
+class AalFrameStatistics;
+class AalTextureBufferMapper;
+struct CameraControl;
+
+/*!
+ * \brief The AalVideoOutput class presents viewfinder frames to one video
+ * surface, with its own pixel format, analysis size, frame rate cap and
+ * readback settings
+ * All outputs share the viewfinder texture, which is updated once per frame
+ * by the preview's video node. The preview surface gets frames holding the
+ * texture, analysis surfaces get frames read back into memory on the render
+ * thread, right after it latched them.
+ */
+class AalVideoOutput
+{
+public:
+    // Viewfinder frame presented to every output
+    struct Frame {
+        GLuint textureId;
+        QSize size;
+        CameraControl *control;
+        CameraChannelPtr channel;
+        qint64 sequence;
+        qint64 time;
+        qint64 presentTime;
+    };
+
+    AalVideoOutput(QAbstractVideoSurface *surface, AalFrameStatistics *statistics);
+    ~AalVideoOutput();
+
+    QAbstractVideoSurface *surface() const { return m_surface; }
+    void setSurface(QAbstractVideoSurface *surface) { m_surface = surface; }
+
+    AalVideoRendererControl::ReadbackMode readbackMode() const { return m_readbackMode; }
+    void setReadbackMode(AalVideoRendererControl::ReadbackMode mode);
+
+    QSize analysisSize() const { return m_analysisSize; }
+    void setAnalysisSize(const QSize &size) { m_analysisSize = size; }
+    QRect analysisCrop() const { return m_analysisCrop; }
+    void setAnalysisCrop(const QRect &rect) { m_analysisCrop = rect; }
+
+    qreal maxFrameRate() const { return m_maxFrameRate; }
+    void setMaxFrameRate(qreal rate) { m_maxFrameRate = rate; }
+
+    bool present(const Frame &frame);
+    void queueLatched(const Frame &frame);
+    bool mapLatched(qint64 sequence);
+    bool presentLatched();
+    bool acceptsMemoryFrames() const;
+    bool presentMemoryFrame(const QVideoFrame &frame);
+    void stop();
+
+    static AalTextureBufferMapper *createMapper();
+
+private:
+    Q_DISABLE_COPY(AalVideoOutput)
+
+    // Frame waiting for the render thread to latch it, with the settings it
+    // is read back with
+    struct Readback {
+        Frame frame;
+        QRect cropRect;
+        QSize size;
+        QVideoFrame::PixelFormat pixelFormat;
+        AalVideoRendererControl::ReadbackMode mode;
+    };
+
+    bool outputGeometry(const QSize &vfSize, QRect *cropRect, QSize *frameSize) const;
+    void configureMapper(const Frame &frame, const QRect &cropRect, const QSize &frameSize,
+                         QVideoFrame::PixelFormat pixelFormat,
+                         AalVideoRendererControl::ReadbackMode mode);
+    QVideoFrame::PixelFormat choosePixelFormat(const QSize &size,
+                                               QAbstractVideoBuffer::HandleType handleType) const;
+    bool isFrameDue(qint64 presentTime) const;
+
+    QPointer<QAbstractVideoSurface> m_surface;
+    AalFrameStatistics *m_statistics;
+    // Shared with the frames presented, which may outlive the output
+    std::shared_ptr<AalTextureBufferMapper> m_mapper;
+    AalVideoRendererControl::ReadbackMode m_readbackMode;
+    QVideoFrame::PixelFormat m_pixelFormat;
+    QSize m_analysisSize;
+    QRect m_analysisCrop;
+    qreal m_maxFrameRate;
+    qint64 m_lastPresentTime;
+
+    // Handed from the GUI thread to the render thread and back
+    QMutex m_latchMutex;
+    bool m_hasPendingReadback;
+    Readback m_pendingReadback;
+    QVideoFrame m_latchedFrame;
+};
+
+#endif // AALVIDEOOUTPUT_H
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2016 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AALVIDEOPROBECONTROL_H
+#define AALVIDEOPROBECONTROL_H
+
+#include <QMediaVideoProbeControl>
+
+/*!
+ * \brief The AalVideoProbeControl class is the control behind one QVideoProbe
+ * attached to the camera
+ * Frames are emitted by AalVideoProber, from its worker thread.
+ */
+class AalVideoProbeControl : public QMediaVideoProbeControl
+{
+    Q_OBJECT
+public:
+    AalVideoProbeControl(QObject *parent = 0);
+    ~AalVideoProbeControl();
+};
+
+#endif // AALVIDEOPROBECONTROL_H
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "aalvideoprober.h"
+#include "aaltexturebuffermapper.h"
+#include "aalvideoprobecontrol.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+#include <QOpenGLContext>
+
+#include <cstring>
+
+AalVideoProber::AalVideoProber(QObject *parent)
+    : QThread(parent),
+      m_hasPendingFrame(false),
+      m_stopping(false)
+{
+}
+
+AalVideoProber::~AalVideoProber()
+{
+    stopWorker();
+
+    // GL objects of the mapper go away with the render thread's context
+    QMutexLocker locker(&m_mapMutex);
+    m_mapper.reset();
+}
+
+/*!
+ * \brief AalVideoProber::addProbe attaches a probe, starting the worker with
+ * the first one
+ */
+void AalVideoProber::addProbe(AalVideoProbeControl *probe)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_probes.append(probe);
+    }
+
+    if (m_active.load()) {
+        return;
+    }
+
+    m_stopping = false;
+    m_active.store(1);
+    start();
+}
+
+/*!
+ * \brief AalVideoProber::removeProbe detaches a probe, stopping the worker
+ * with the last one
+ */
+void AalVideoProber::removeProbe(AalVideoProbeControl *probe)
+{
+    bool empty;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_probes.removeAll(probe);
+        empty = m_probes.isEmpty();
+    }
+
+    if (empty) {
+        stopWorker();
+    }
+}
+
+/*!
+ * \brief AalVideoProber::probe remembers a presented frame, to be read back
+ * once the render thread has latched it. A frame still waiting for that is
+ * dropped.
+ */
+void AalVideoProber::probe(const AalVideoOutput::Frame &frame)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_active.load()) {
+        return;
+    }
+
+    if (m_hasPendingFrame) {
+        m_droppedFrames.ref();
+    }
+    m_pendingFrame = frame;
+    m_hasPendingFrame = true;
+}
+
+/*!
+ * \brief AalVideoProber::mapLatched reads back the frame waiting for the
+ * given sequence number, or an earlier one, and queues it for the worker
+ * Called on the render thread after it latched the frame, with its context
+ * current.
+ */
+void AalVideoProber::mapLatched(qint64 sequence)
+{
+    AalVideoOutput::Frame frame;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_active.load() || !m_hasPendingFrame || m_pendingFrame.sequence > sequence) {
+            return;
+        }
+        frame = m_pendingFrame;
+        m_hasPendingFrame = false;
+    }
+
+    if (!QOpenGLContext::currentContext()) {
+        qWarning() << "No OpenGL context current on the render thread, cannot probe frame";
+        return;
+    }
+
+    QVideoFrame probed;
+    {
+        QMutexLocker locker(&m_mapMutex);
+        if (!m_mapper) {
+            m_mapper.reset(AalVideoOutput::createMapper());
+        }
+        probed = mapFrame(m_mapper.get(), frame);
+    }
+    if (!probed.isValid()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_active.load()) {
+        return;
+    }
+    if (m_queue.size() >= MaxQueueLength) {
+        m_queue.dequeue();
+        m_droppedFrames.ref();
+    }
+    m_queue.enqueue(probed);
+    m_frameAvailable.wakeOne();
+}
+
+/*!
+ * \brief AalVideoProber::flush drops the queued frames, and tells the probes
+ * that the frames they got belong to a stream that stopped
+ */
+void AalVideoProber::flush()
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue.clear();
+    m_hasPendingFrame = false;
+    Q_FOREACH(AalVideoProbeControl *probe, m_probes) {
+        Q_EMIT probe->flush();
+    }
+}
+
+void AalVideoProber::stopWorker()
+{
+    if (!m_active.load()) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_active.store(0);
+        m_stopping = true;
+        m_queue.clear();
+        m_hasPendingFrame = false;
+        m_frameAvailable.wakeOne();
+    }
+    wait();
+}
+
+void AalVideoProber::run()
+{
+    Q_FOREVER {
+        QVideoFrame probed;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_stopping) {
+                m_frameAvailable.wait(&m_mutex);
+            }
+            if (m_stopping) {
+                break;
+            }
+            probed = m_queue.dequeue();
+        }
+
+        QMutexLocker locker(&m_mutex);
+        Q_FOREACH(AalVideoProbeControl *probe, m_probes) {
+            Q_EMIT probe->videoFrameProbed(probed);
+        }
+    }
+}
+
+/*!
+ * \brief AalVideoProber::mapFrame reads a viewfinder frame back into a
+ * frame in memory, which probes can map without a GL context
+ */
+QVideoFrame AalVideoProber::mapFrame(AalTextureBufferMapper *mapper, const AalVideoOutput::Frame &frame)
+{
+    mapper->setTextureId(frame.textureId);
+    mapper->setFrameSequence(frame.sequence);
+    mapper->setSize(frame.size);
+    mapper->setPixelFormat(QVideoFrame::Format_RGB32);
+
+    int numBytes = 0;
+    int bytesPerLine = 0;
+    const uchar *bits = mapper->map(QAbstractVideoBuffer::ReadOnly, &numBytes, &bytesPerLine);
+    if (!bits) {
+        return QVideoFrame();
+    }
+
+    QVideoFrame probed(numBytes, frame.size, bytesPerLine, QVideoFrame::Format_RGB32);
+    if (probed.map(QAbstractVideoBuffer::WriteOnly)) {
+        memcpy(probed.bits(), bits, numBytes);
+        probed.unmap();
+    }
+    mapper->unmap();
+
+    probed.setStartTime(frame.time);
+    probed.setMetaData("SequenceNumber", frame.sequence);
+    return probed;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2012 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AALVIDEOPROBER_H
+#define AALVIDEOPROBER_H
+
+#include "aalvideooutput.h"
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QVideoFrame>
+#include <QWaitCondition>
+
+#include <memory>
+
+class AalTextureBufferMapper;
+class AalVideoProbeControl;
+
+/*!
+ * \brief The AalVideoProber class maps viewfinder frames for the attached
+ * video probes
+ * Frames are read back on the render thread, right after the scene graph
+ * latched them into the viewfinder texture, so that they are never read
+ * while the texture is updated. A worker thread, which only runs while at
+ * least one probe is attached, delivers them to the probes. Frames wait in a
+ * short queue, where the oldest ones are dropped when the worker lags behind.
+ */
+class AalVideoProber : public QThread
+{
+    Q_OBJECT
+public:
+    AalVideoProber(QObject *parent = 0);
+    ~AalVideoProber();
+
+    void addProbe(AalVideoProbeControl *probe);
+    void removeProbe(AalVideoProbeControl *probe);
+
+    bool isActive() const { return m_active.load(); }
+    void probe(const AalVideoOutput::Frame &frame);
+    void mapLatched(qint64 sequence);
+    void flush();
+
+    int droppedFrameCount() const { return m_droppedFrames.load(); }
+
+protected:
+    void run() override;
+
+private:
+    static const int MaxQueueLength = 2;
+
+    void stopWorker();
+    QVideoFrame mapFrame(AalTextureBufferMapper *mapper, const AalVideoOutput::Frame &frame);
+
+    QAtomicInt m_active;
+    QAtomicInt m_droppedFrames;
+
+    QMutex m_mutex;
+    QWaitCondition m_frameAvailable;
+    bool m_hasPendingFrame;
+    AalVideoOutput::Frame m_pendingFrame;
+    QQueue<QVideoFrame> m_queue;
+    QList<AalVideoProbeControl*> m_probes;
+    bool m_stopping;
+
+    // Only used on the render thread, the lock keeps it alive while mapping
+    QMutex m_mapMutex;
+    std::unique_ptr<AalTextureBufferMapper> m_mapper;
+};
+
+#endif // AALVIDEOPROBER_H
@@ -16,10 +16,10 @@
 
 #include "aalvideorenderercontrol.h"
 #include "aalcameraservice.h"
+#include "aalvideooutput.h"
+#include "aalvideoprober.h"
 #include "aalviewfindersettingscontrol.h"
 
-#include "media_signals.h"
-
 #include <hybris/camera/camera_compatibility_layer.h>
 #include <hybris/camera/camera_compatibility_layer_capabilities.h>
 
@@ -29,485 +29,35 @@
 #include <QTimer>
 #include <QUrl>
 #include <QVideoSurfaceFormat>
-#include <QOpenGLContext>
-#include <QOpenGLVertexArrayObject>
-#include <QOpenGLBuffer>
-#include <QOpenGLFunctions>
-#include <QOpenGLShaderProgram>
 #include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QOpenGLContext>
 
-#include <hybris/common/dlfcn.h>
-#include <hybris/ui/ui_compatibility_layer.h>
-#include <hardware/gralloc.h>
-
-#include <EGL/egl.h>
-#include <EGL/eglext.h>
-
-#include <dlfcn.h>
 #include <memory>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-#ifndef GL_TEXTURE_EXTERNAL_OES
-#define GL_TEXTURE_EXTERNAL_OES 0x8D65
-#endif
-
-const int32_t GB_FORMAT = HAL_PIXEL_FORMAT_RGBA_8888;
-const uint32_t GB_ALLOC_USAGE =
-        GRALLOC_USAGE_HW_TEXTURE |
-        GRALLOC_USAGE_SW_READ_OFTEN |
-        GRALLOC_USAGE_SW_WRITE_NEVER;
-
-class AalTextureBufferMapper {
-public:
-    AalTextureBufferMapper() :
-        m_textureId(0),
-        m_width(0),
-        m_height(0),
-        m_mapMode(QAbstractVideoBuffer::NotMapped)
-    {}
-    virtual ~AalTextureBufferMapper() {}
-
-    void setTextureId(GLuint textureId) { m_textureId = textureId; }
-    void setSize(const QSize& size)
-    {
-        m_width = size.width();
-        m_height = size.height();
-    }
-
-    virtual QAbstractVideoBuffer::MapMode mapMode() const = 0;
-    virtual uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) = 0;
-    virtual void unmap() = 0;
-
-protected:
-    GLuint m_textureId;
-    int m_width;
-    int m_height;
-    QAbstractVideoBuffer::MapMode m_mapMode;
-};
-
-class AalTextureBufferGraphicMapper : public AalTextureBufferMapper {
-public:
-    AalTextureBufferGraphicMapper() :
-        AalTextureBufferMapper(),
-        m_graphicBuffer(nullptr),
-        m_vramAddr(nullptr),
-        m_eglImage(EGL_NO_IMAGE_KHR)
-    {
-        eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
-        eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
-        glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
-    }
-
-    ~AalTextureBufferGraphicMapper()
-    {
-    }
-
-    QAbstractVideoBuffer::MapMode mapMode() const override
-    {
-        return m_mapMode;
-    }
-
-    uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) override
-    {
-        if (mode != QAbstractVideoBuffer::ReadOnly) {
-            qWarning() << "Tried to map in unsupported mode:" << mode;
-            return nullptr;
-        }
-
-        if (m_width <= 0 || m_height <= 0) {
-            qWarning() << "Tried to map buffer of invalid dimensions, cannot map memory.";
-            return nullptr;
-        }
-
-        // Already mapped? Return the address then
-        if (m_vramAddr) {
-            const int stride = graphic_buffer_get_stride(m_graphicBuffer);
-            m_mapMode = mode;
-            *numBytes = m_width * stride * 4;
-            *bytesPerLine = stride * 4;
-            return (uchar*)m_vramAddr;
-        }
-
-        if (!(eglCreateImageKHR && eglDestroyImageKHR && glEGLImageTargetTexture2DOES)) {
-            qWarning() << "EGLImageKHR functions not found, cannot map memory.";
-            return nullptr;
-        }
-
-        if (!QOpenGLContext::currentContext()) {
-            qWarning() << "OpenGL context is not current, cannot map memory.";
-            return nullptr;
-        }
-
-        if (!m_shader.get() && !compileShaders()) {
-            return nullptr;
-        }
-
-        QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
-
-        // Resize intermediate GraphicBuffer for accessing the texture through EGLImageKHR
-        if (!m_graphicBuffer) {
-            m_graphicBuffer = graphic_buffer_new_sized(m_width, m_height, GB_FORMAT, GB_ALLOC_USAGE);
-        }
-
-        // Create EGLImageKHR from the m_graphicBuffer for readback purposes
-        EGLClientBuffer eglClientBuffer = (EGLClientBuffer)graphic_buffer_get_native_buffer(m_graphicBuffer);
-        if (m_eglImage == EGL_NO_IMAGE_KHR) {
-            EGLDisplay dpy = eglGetCurrentDisplay();
-            EGLContext context = EGL_NO_CONTEXT;
-            EGLint attrs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE,
-                               EGL_NONE };
-            m_eglImage = eglCreateImageKHR(dpy, context, EGL_NATIVE_BUFFER_ANDROID, eglClientBuffer, attrs);
-        }
-
-        // Texture that is going to receive the viewfinder's data, bound with the EGLImage
-        GLuint targetTexture;
-        gl->glGenTextures(1, &targetTexture);
-        gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, targetTexture);
-        gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        gl->glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, m_eglImage);
-
-        GLuint fbo;
-        gl->glGenFramebuffers(1, &fbo);
-        gl->glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_EXTERNAL_OES, targetTexture, 0);
-
-        // Draw the target texture to copy the viewfinder texture into the EGLImage
-        renderWithShader(gl);
-
-        // Cleanup & finish drawing
-        gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        gl->glDeleteFramebuffers(1, &fbo);
-        gl->glBindTexture(GL_TEXTURE_2D, 0);
-        gl->glDeleteTextures(1, &targetTexture);
-        gl->glFinish();
-
-        // Map pixel data from the GraphicBuffer
-        graphic_buffer_lock(m_graphicBuffer, GRALLOC_USAGE_SW_READ_OFTEN, &m_vramAddr);
-        if (!m_vramAddr) {
-            qWarning() << "Failed to lock GraphicBuffer";
-            graphic_buffer_free(m_graphicBuffer);
-            m_graphicBuffer = nullptr;
-            return nullptr;
-        }
-
-        const int stride = graphic_buffer_get_stride(m_graphicBuffer);
-        m_mapMode = mode;
-        *numBytes = m_height * stride * 4;
-        *bytesPerLine = stride * 4;
-
-        return (uchar*)m_vramAddr;
-    }
-
-    void unmap() override
-    {
-        if (!(eglCreateImageKHR && eglDestroyImageKHR && glEGLImageTargetTexture2DOES)) {
-            qWarning() << "EGLImageKHR functions not found, cannot unmap memory.";
-            return;
-        }
-
-        if (m_eglImage != EGL_NO_IMAGE_KHR) {
-            eglDestroyImageKHR(eglGetCurrentDisplay(), m_eglImage);
-            m_eglImage = EGL_NO_IMAGE_KHR;
-        }
-
-        if (m_graphicBuffer) {
-            graphic_buffer_unlock(m_graphicBuffer);
-            graphic_buffer_free(m_graphicBuffer);
-            m_graphicBuffer = nullptr;
-            m_vramAddr = nullptr;
-        }
-    }
-
-private:
-    void renderWithShader(QOpenGLFunctions* gl)
-    {
-        const auto width = m_width;
-        const auto height = m_height;
-        const int textureUnit = 1;
-
-        static const GLfloat vertex_buffer_data[] = {
-            -1,-1, 0,
-            -1, 1, 0,
-             1,-1, 0,
-            -1, 1, 0,
-             1,-1, 0,
-             1, 1, 0
-        };
-
-        static const GLfloat texture_buffer_data[] = {
-            0, 0,
-            0, 1,
-            1, 0,
-            0, 1,
-            1, 0,
-            1, 1
-        };
-
-        QOpenGLVertexArrayObject vao;
-        QOpenGLBuffer vertexBuffer;
-        QOpenGLBuffer textureBuffer;
-
-        m_shader->bind();
-
-        gl->glActiveTexture(GL_TEXTURE0 + textureUnit);
-        gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, m_textureId);
-
-        gl->glViewport(0, 0, width, height);
-
-        vao.create();
-        vao.bind();
-
-        vertexBuffer.create();
-        vertexBuffer.bind();
-        vertexBuffer.allocate(vertex_buffer_data, sizeof(vertex_buffer_data));
-        m_shader->setAttributeBuffer("vertexCoord", GL_FLOAT, 0, 3, 0);
-        m_shader->enableAttributeArray("vertexCoord");
-        vertexBuffer.release();
-
-        textureBuffer.create();
-        textureBuffer.bind();
-        textureBuffer.allocate(texture_buffer_data, sizeof(texture_buffer_data));
-        m_shader->setAttributeBuffer("textureCoord", GL_FLOAT, 0, 2, 0);
-        m_shader->enableAttributeArray("textureCoord");
-        textureBuffer.release();
-
-        m_shader->setUniformValue("tex", textureUnit);
-
-        gl->glDrawArrays(GL_TRIANGLES, 0, 6);
-
-        m_shader->disableAttributeArray("textureCoord");
-        m_shader->disableAttributeArray("vertexCoord");
-        vertexBuffer.destroy();
-        textureBuffer.destroy();
-
-        vao.release();
-        m_shader->release();
-
-        gl->glActiveTexture(GL_TEXTURE0);
-    }
-
-    bool compileShaders()
-    {
-        static const GLchar* VERTEX_SHADER = {
-            "#version 100\n"
-            "attribute highp vec3 vertexCoord;\n"
-            "attribute highp vec2 textureCoord;\n"
-            "varying highp vec2 uv;\n"
-            "\n"
-            "void main() {\n"
-            "    uv = textureCoord.xy;\n"
-            "    gl_Position = vec4(vertexCoord,1.0);\n"
-            "}\n"
-        };
-
-        static const GLchar* FRAGMENT_SHADER = {
-            "#version 100\n"
-            "#extension GL_OES_EGL_image_external : require\n"
-            "uniform samplerExternalOES tex;\n"
-            "varying highp vec2 uv;\n"
-            "\n"
-            "void main() {\n"
-            "    gl_FragColor.bgra = texture2D(tex, uv).bgra;\n"
-            "}\n"
-        };
-
-        auto program = std::make_shared<QOpenGLShaderProgram>();
-        bool success = false;
-
-        success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, VERTEX_SHADER);
-        if (!success) {
-            qWarning() << "Failed to compile vertex shader. Reason:" << program->log();
-            return false;
-        }
-
-        success = program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, FRAGMENT_SHADER);
-        if (!success) {
-            qWarning() << "Failed to compile fragment shader. Reason:" << program->log();
-            return false;
-        }
-
-        success = program->link();
-        if (!success) {
-            qWarning() << "Failed to link shader. Reason:" << program->log();
-            return false;
-        }
-
-        m_shader = program;
-        return true;
-    }
-
-    std::shared_ptr<QOpenGLShaderProgram> m_shader;
-    struct graphic_buffer* m_graphicBuffer;
-    void* m_vramAddr;
-    EGLImageKHR m_eglImage;
-
-    PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
-    PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
-    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
-};
-
-class AalTextureBufferPixelReadMapper : public AalTextureBufferMapper {
-public:
-    AalTextureBufferPixelReadMapper() :
-        AalTextureBufferMapper(),
-        m_pixelBuffer(nullptr)
-    {
-    }
-
-    QAbstractVideoBuffer::MapMode mapMode() const override
-    {
-        return m_mapMode;
-    }
-
-    uchar* map(QAbstractVideoBuffer::MapMode mode, int* numBytes, int* bytesPerLine) override
-    {
-        if (mode != QAbstractVideoBuffer::ReadOnly) {
-            qWarning() << "Tried to map in unsupported mode:" << mode;
-            return nullptr;
-        }
-
-        if (m_width <= 0 || m_height <= 0) {
-            qWarning() << "Tried to map buffer of invalid dimensions, cannot map memory.";
-            return nullptr;
-        }
-
-        if (!QOpenGLContext::currentContext()) {
-            qWarning() << "OpenGL context is not current, cannot map memory.";
-            return nullptr;
-        }
-
-        // The only supported mode is read-only, hence re-create a new byte array
-        // on subsequent map operations on the same mapper object.
-        if (m_pixelBuffer) {
-            delete[] m_pixelBuffer;
-        }
-        m_pixelBuffer = new uint8_t[m_width * m_height * 4];
-
-        QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
-        GLuint fbo;
-        gl->glGenFramebuffers(1, &fbo);
-        gl->glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        gl->glBindTexture(GL_TEXTURE_EXTERNAL_OES, m_textureId);
-        gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_EXTERNAL_OES, m_textureId, 0);
-        gl->glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, m_pixelBuffer);
-        gl->glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        gl->glBindTexture(GL_TEXTURE_2D, 0);
-        gl->glDeleteFramebuffers(1, &fbo);
-
-        m_mapMode = mode;
-        *numBytes = m_width * m_height * 4;
-        *bytesPerLine = m_width * 4;
-        return m_pixelBuffer;
-    }
-
-    void unmap() override
-    {
-        if (m_pixelBuffer) {
-            delete[] m_pixelBuffer;
-            m_pixelBuffer = nullptr;
-        }
-    }
-
-private:
-    uchar* m_pixelBuffer;
-};
-
-class AalGLTextureBuffer : public QAbstractVideoBuffer
-{
-public:
-    AalGLTextureBuffer(GLuint textureId, AalTextureBufferMapper* mapper) :
-        QAbstractVideoBuffer(QAbstractVideoBuffer::GLTextureHandle),
-        m_textureId(textureId),
-        m_mapper(mapper)
-    {
-    }
-
-    ~AalGLTextureBuffer()
-    {
-    }
-
-    MapMode mapMode() const
-    {
-        if (!m_mapper)
-            return QAbstractVideoBuffer::NotMapped;
-        return m_mapper->mapMode();
-    }
-
-    uchar *map(MapMode mode, int *numBytes, int *bytesPerLine)
-    {
-        if (!m_mapper)
-            return nullptr;
-        return m_mapper->map(mode, numBytes, bytesPerLine);
-    }
-
-    void unmap()
-    {
-        if (!m_mapper)
-            return;
-        m_mapper->unmap();
-    }
-
-    QVariant handle() const
-    {
-        return QVariant::fromValue<unsigned int>(m_textureId);
-    }
-
-    GLuint textureId() { return m_textureId; }
-
-private:
-    GLuint m_textureId;
-    AalTextureBufferMapper* m_mapper;
-};
-
-bool fileExists(const std::string& filename) {
-    struct stat buffer;
-    return (stat(filename.c_str(), &buffer) == 0);
-}
+#include <utility>
 
 AalVideoRendererControl::AalVideoRendererControl(AalCameraService *service, QObject *parent)
     : QVideoRendererControl(parent)
     , m_surface(0),
       m_service(service),
       m_viewFinderRunning(false),
-      m_previewStarted(false),
-      m_textureId(0)
+      m_previewStarted(0),
+      m_textureId(0),
+      m_channel(std::make_shared<CameraChannel>(this)),
+      m_presentedSequence(0),
+      m_previewCallbackEnabled(false),
+      m_previewCallbackActive(0)
 {
-    {
-#ifdef __LP64__
-        static const char* ldpath = "/system/lib64/libui_compat_layer.so";
-#else
-        static const char* ldpath = "/system/lib/libui_compat_layer.so";
-#endif
-        void* handle = hybris_dlopen(ldpath, RTLD_LAZY);
-
-        bool useGlReadPixels = fileExists("/usr/lib/droidian/device/aal-glreadpixels");
-
-        if (!handle || useGlReadPixels) {
-            qDebug() << "AalTextureBufferPixelReadMapper";
-            m_mapper = new AalTextureBufferPixelReadMapper();
-        } else {
-            qDebug() << "AalTextureBufferGraphicMapper";
-            m_mapper = new AalTextureBufferGraphicMapper();
-            hybris_dlclose(handle);
-        }
-    }
+    qRegisterMetaType<QVideoFrame>();
 
-    // Get notified when qtvideo-node creates a GL texture
-    connect(SharedSignal::instance(), SIGNAL(textureCreated(unsigned int)), this, SLOT(onTextureCreated(unsigned int)));
-    connect(SharedSignal::instance(), SIGNAL(snapshotTaken(QImage)), this, SLOT(onSnapshotTaken(QImage)));
+    m_output = new AalVideoOutput(0, &m_statistics);
 }
 
 AalVideoRendererControl::~AalVideoRendererControl()
 {
-    if (m_mapper) {
-        delete m_mapper;
-        m_mapper = nullptr;
-    }
+    // The video node may still hold the channel
+    m_channel->detach();
+    delete m_output;
 }
 
 QAbstractVideoSurface *AalVideoRendererControl::surface() const
@@ -519,28 +69,38 @@ void AalVideoRendererControl::setSurface(QAbstractVideoSurface *surface)
 {
     if (m_surface != surface) {
         m_surface = surface;
+        m_output->setSurface(surface);
         Q_EMIT surfaceChanged(surface);
     }
 }
 
 void AalVideoRendererControl::init(CameraControl *control, CameraControlListener *listener)
 {
-    Q_UNUSED(control);
     listener->on_preview_texture_needs_update_cb = &AalVideoRendererControl::updateViewfinderFrameCB;
+    listener->on_preview_frame_cb = &AalVideoRendererControl::previewFrameCB;
+    if (m_previewCallbackActive.load()) {
+        android_camera_set_preview_callback_mode(control, PREVIEW_CALLBACK_ENABLED);
+    }
     // ensures a new texture will be created by qtvideo-node
     m_textureId = 0;
 }
 
 void AalVideoRendererControl::startPreview()
 {
-    if (m_previewStarted) {
+    if (m_previewStarted.load()) {
         return;
     }
     if (!m_service->androidControl()) {
         qWarning() << "Can't start preview without a CameraControl";
         return;
     }
-    m_previewStarted = true;
+
+    // The size only changes while the preview is stopped
+    if (m_service->viewfinderControl()) {
+        QMutexLocker locker(&m_previewSizeMutex);
+        m_previewSize = m_service->viewfinderControl()->currentSize();
+    }
+    m_previewStarted.storeRelease(1);
 
     if (m_textureId) {
         CameraControl *cc = m_service->androidControl();
@@ -558,7 +118,7 @@ void AalVideoRendererControl::startPreview()
 
 void AalVideoRendererControl::stopPreview()
 {
-    if (!m_previewStarted) {
+    if (!m_previewStarted.load()) {
         return;
     }
     if (!m_service->androidControl()) {
@@ -570,8 +130,12 @@ void AalVideoRendererControl::stopPreview()
         return;
     }
 
-    if (m_surface->isActive()) {
-        m_surface->stop();
+    m_output->stop();
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, m_analysisOutputs) {
+        output->stop();
+    }
+    if (m_service->videoProber()) {
+        m_service->videoProber()->flush();
     }
 
     CameraControl *cc = m_service->androidControl();
@@ -579,13 +143,182 @@ void AalVideoRendererControl::stopPreview()
     // FIXME: missing android_camera_set_preview_size(QSize())
     android_camera_set_preview_texture(cc, 0);
 
-    m_previewStarted = false;
+    m_previewStarted.storeRelease(0);
     m_service->updateCaptureReady();
 }
 
 bool AalVideoRendererControl::isPreviewStarted() const
 {
-    return m_previewStarted;
+    return m_previewStarted.load();
+}
+
+AalVideoRendererControl::ReadbackMode AalVideoRendererControl::readbackMode() const
+{
+    return m_output->readbackMode();
+}
+
+/*!
+ * \brief AalVideoRendererControl::setReadbackMode selects how mapping a
+ * viewfinder frame reads its pixels back
+ * ExactReadback blocks until the mapped frame has been read back.
+ * LatestReadback pipelines the readback through pixel pack buffers, where
+ * available, and returns the frame read on the previous map instead.
+ * NonBlockingReadback never waits for the copy of the frame: mapping returns
+ * no data, with the mapper status MapNotReady, while the copy is in flight.
+ * The next frame's map picks the copy up once done, so mapped frames lag by
+ * one frame at most; older copies are dropped and made again.
+ */
+void AalVideoRendererControl::setReadbackMode(ReadbackMode mode)
+{
+    if (m_output->readbackMode() == mode)
+        return;
+
+    m_output->setReadbackMode(mode);
+    Q_EMIT readbackModeChanged(mode);
+}
+
+QSize AalVideoRendererControl::analysisSize() const
+{
+    return m_output->analysisSize();
+}
+
+/*!
+ * \brief AalVideoRendererControl::setAnalysisSize sets the size viewfinder
+ * frames are mapped at
+ * Mapping a frame then scales it on the GPU before reading it back, which is
+ * cheaper than reading back the full resolution and scaling on the CPU.
+ * An invalid size maps frames at the size of the analysis crop rectangle.
+ */
+void AalVideoRendererControl::setAnalysisSize(const QSize &size)
+{
+    if (m_output->analysisSize() == size)
+        return;
+
+    m_output->setAnalysisSize(size);
+    Q_EMIT analysisSizeChanged(size);
+}
+
+QRect AalVideoRendererControl::analysisCrop() const
+{
+    return m_output->analysisCrop();
+}
+
+/*!
+ * \brief AalVideoRendererControl::setAnalysisCrop restricts mapped viewfinder
+ * frames to a rectangle of the viewfinder, in viewfinder pixels
+ * The rectangle in use is attached to each frame as the "CropRect" metadata.
+ * An invalid rectangle maps the whole viewfinder.
+ */
+void AalVideoRendererControl::setAnalysisCrop(const QRect &rect)
+{
+    if (m_output->analysisCrop() == rect)
+        return;
+
+    m_output->setAnalysisCrop(rect);
+    Q_EMIT analysisCropChanged(rect);
+}
+
+bool AalVideoRendererControl::isPreviewCallbackEnabled() const
+{
+    return m_previewCallbackEnabled;
+}
+
+/*!
+ * \brief AalVideoRendererControl::setPreviewCallbackEnabled turns the HAL
+ * preview callback on or off
+ * While it is on, analysis surfaces taking NV21 frames in memory get the
+ * frames the HAL copies to the CPU, instead of frames read back from the
+ * viewfinder texture. The HAL only copies frames while such a surface is
+ * attached.
+ */
+void AalVideoRendererControl::setPreviewCallbackEnabled(bool enabled)
+{
+    if (m_previewCallbackEnabled == enabled)
+        return;
+
+    m_previewCallbackEnabled = enabled;
+    updatePreviewCallbackMode();
+    Q_EMIT previewCallbackEnabledChanged(enabled);
+}
+
+/*!
+ * \brief AalVideoRendererControl::updatePreviewCallbackMode turns the HAL
+ * preview callback on when it is enabled and an analysis surface takes its
+ * frames, and off otherwise
+ */
+void AalVideoRendererControl::updatePreviewCallbackMode()
+{
+    bool active = false;
+    if (m_previewCallbackEnabled) {
+        Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, m_analysisOutputs) {
+            active = active || output->acceptsMemoryFrames();
+        }
+    }
+
+    if (int(active) == m_previewCallbackActive.load())
+        return;
+
+    m_previewCallbackActive.storeRelease(active);
+    CameraControl *cc = m_service->androidControl();
+    if (cc) {
+        android_camera_set_preview_callback_mode(cc, active ? PREVIEW_CALLBACK_ENABLED
+                                                            : PREVIEW_CALLBACK_DISABLED);
+    }
+}
+
+/*!
+ * \brief AalVideoRendererControl::coalescedFrameCount returns the number of
+ * viewfinder frames that arrived while an update was already queued, and were
+ * presented by that update
+ */
+int AalVideoRendererControl::coalescedFrameCount() const
+{
+    return m_coalescedFrames.load();
+}
+
+/*!
+ * \brief AalVideoRendererControl::droppedFrameCount returns the number of
+ * viewfinder frames that arrived while the preview was not started, and of
+ * preview callback frames that found no free buffer
+ */
+int AalVideoRendererControl::droppedFrameCount() const
+{
+    return m_droppedFrames.load();
+}
+
+/*!
+ * \brief AalVideoRendererControl::skippedLatchCount returns the number of
+ * times the viewfinder was rendered without a new camera buffer, so that its
+ * texture was left as it was
+ */
+int AalVideoRendererControl::skippedLatchCount() const
+{
+    return m_skippedLatches.load();
+}
+
+/*!
+ * \brief AalVideoRendererControl::frameStatistics returns the percentiles of
+ * the latest viewfinder latencies, in microseconds, along with the frame
+ * counters
+ * Latencies are measured from the HAL frame callback to the frame being
+ * presented, from the frame being presented to it being rendered, and for
+ * mapping a frame.
+ */
+QVariantMap AalVideoRendererControl::frameStatistics() const
+{
+    QVariantMap statistics = m_statistics.toVariantMap();
+    statistics.insert("coalescedFrames", coalescedFrameCount());
+    statistics.insert("droppedFrames", droppedFrameCount());
+    statistics.insert("skippedLatches", skippedLatchCount());
+    return statistics;
+}
+
+void AalVideoRendererControl::resetFrameCounters()
+{
+    m_coalescedFrames.store(0);
+    m_droppedFrames.store(0);
+    m_skippedLatches.store(0);
+    m_statistics.reset();
 }
 
 void AalVideoRendererControl::updateViewfinderFrame()
@@ -603,58 +336,277 @@ void AalVideoRendererControl::updateViewfinderFrame()
         return;
     }
 
-    QSize vfSize = m_service->viewfinderControl()->currentSize();
-    m_mapper->setTextureId(m_textureId);
-    m_mapper->setSize(vfSize);
-    QVideoFrame frame(new AalGLTextureBuffer(m_textureId, m_mapper), vfSize, QVideoFrame::Format_RGB32);
+    AalVideoOutput::Frame frame;
+    frame.textureId = m_textureId;
+    frame.size = m_service->viewfinderControl()->currentSize();
+    frame.control = m_service->androidControl();
+    frame.channel = m_channel;
+    frame.sequence = m_channel->frameClock(&frame.time);
+    frame.presentTime = CameraChannel::monotonicTime();
 
-    if (!frame.isValid()) {
-        qWarning() << "Invalid frame";
+    // Only frames coming from a new HAL callback have a meaningful latency
+    if (frame.sequence != m_presentedSequence) {
+        m_statistics.addSample(AalFrameStatistics::CallbackToPresent, frame.presentTime - frame.time);
+        m_presentedSequence = frame.sequence;
+    }
+
+    m_output->present(frame);
+
+    // Analysis surfaces map the texture updated for the preview, there is
+    // nothing to map until it exists
+    if (!m_textureId) {
         return;
     }
 
-    CameraControl *cc = m_service->androidControl();
-    frame.setMetaData("CamControl", QVariant::fromValue((void*)cc));
+    // Costs a single atomic load while no probe is attached
+    AalVideoProber *prober = m_service->videoProber();
+    if (prober && prober->isActive()) {
+        prober->probe(frame);
+    }
+
+    // Analysis surfaces get the frame once the render thread latched it
+    for (int i = m_analysisOutputs.size() - 1; i >= 0; i--) {
+        const std::shared_ptr<AalVideoOutput> output = m_analysisOutputs.at(i);
+        if (!output->surface()) {
+            // The surface was destroyed without being removed
+            {
+                QMutexLocker locker(&m_analysisOutputsMutex);
+                m_analysisOutputs.removeAt(i);
+            }
+            updatePreviewCallbackMode();
+            Q_EMIT analysisSurfacesChanged();
+            continue;
+        }
+        if (m_previewCallbackActive.load() && output->acceptsMemoryFrames()) {
+            continue;
+        }
+        output->queueLatched(frame);
+    }
+}
 
-    if (!m_surface->isActive()) {
-        QVideoSurfaceFormat format(frame.size(), frame.pixelFormat(), frame.handleType());
+/*!
+ * \brief AalVideoRendererControl::addAnalysisSurface feeds viewfinder frames
+ * to an additional surface, next to the preview one
+ * The surface negotiates its own format, and gets frames in memory, read back
+ * at the given analysis size and crop rectangle, at most maxFrameRate times
+ * per second when maxFrameRate is positive.
+ * Clients reach it through the renderer control of the camera's service,
+ * which is also what the viewfinder draws from:
+ * \code
+ * QMediaService *service = camera->service();
+ * QVideoRendererControl *control = service->requestControl<QVideoRendererControl*>();
+ * QMetaObject::invokeMethod(control, "addAnalysisSurface",
+ *                           Q_ARG(QAbstractVideoSurface*, surface),
+ *                           Q_ARG(QSize, QSize(320, 240)));
+ * \endcode
+ * Adding a surface already fed only updates its settings.
+ */
+void AalVideoRendererControl::addAnalysisSurface(QAbstractVideoSurface *surface, const QSize &size,
+                                                 const QRect &crop, ReadbackMode mode,
+                                                 qreal maxFrameRate)
+{
+    if (!surface) {
+        return;
+    }
 
-        if (!m_surface->start(format)) {
-            qWarning() << "Failed to start viewfinder with format:" << format;
+    std::shared_ptr<AalVideoOutput> output;
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &analysisOutput, m_analysisOutputs) {
+        if (analysisOutput->surface() == surface) {
+            output = analysisOutput;
         }
     }
+    const bool added = !output;
+    if (added) {
+        output = std::make_shared<AalVideoOutput>(surface, &m_statistics);
+        QMutexLocker locker(&m_analysisOutputsMutex);
+        m_analysisOutputs.append(output);
+    }
+
+    output->setAnalysisSize(size);
+    output->setAnalysisCrop(crop);
+    output->setReadbackMode(mode);
+    output->setMaxFrameRate(maxFrameRate);
 
-    if (m_surface->isActive()) {
-        m_surface->present(frame);
+    if (added) {
+        updatePreviewCallbackMode();
+        Q_EMIT analysisSurfacesChanged();
     }
 }
 
+void AalVideoRendererControl::removeAnalysisSurface(QAbstractVideoSurface *surface)
+{
+    bool removed = false;
+    for (int i = m_analysisOutputs.size() - 1; i >= 0; i--) {
+        if (m_analysisOutputs.at(i)->surface() == surface) {
+            m_analysisOutputs.at(i)->stop();
+            QMutexLocker locker(&m_analysisOutputsMutex);
+            m_analysisOutputs.removeAt(i);
+            removed = true;
+        }
+    }
+
+    if (removed) {
+        updatePreviewCallbackMode();
+        Q_EMIT analysisSurfacesChanged();
+    }
+}
+
+QObjectList AalVideoRendererControl::analysisSurfaces() const
+{
+    QObjectList surfaces;
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, m_analysisOutputs) {
+        if (output->surface()) {
+            surfaces.append(output->surface());
+        }
+    }
+    return surfaces;
+}
+
 void AalVideoRendererControl::onTextureCreated(GLuint textureID)
 {
     m_textureId = textureID;
     CameraControl *cc = m_service->androidControl();
     if (cc) {
         android_camera_set_preview_texture(cc, m_textureId);
-        if (m_textureId && m_previewStarted) {
+        if (m_textureId && m_previewStarted.load()) {
             android_camera_start_preview(cc);
         }
     }
     m_service->updateCaptureReady();
 }
 
+void AalVideoRendererControl::presentPreviewFrame(const QVideoFrame &frame)
+{
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, m_analysisOutputs) {
+        if (output->acceptsMemoryFrames()) {
+            output->presentMemoryFrame(frame);
+        }
+    }
+}
+
+void AalVideoRendererControl::presentAnalysisFrames()
+{
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, m_analysisOutputs) {
+        output->presentLatched();
+    }
+}
+
+/*!
+ * \brief AalVideoRendererControl::textureCreated gets the texture created by
+ * qtvideo-node for the viewfinder, and hands it to the camera in the GUI thread
+ */
+void AalVideoRendererControl::textureCreated(unsigned int textureId)
+{
+    QMetaObject::invokeMethod(this, "onTextureCreated", Qt::QueuedConnection,
+                              Q_ARG(unsigned int, textureId));
+}
+
+void AalVideoRendererControl::snapshotTaken(QImage image)
+{
+    QMetaObject::invokeMethod(this, "onSnapshotTaken", Qt::QueuedConnection,
+                              Q_ARG(QImage, image));
+}
+
+// Statistics take samples from any thread, no need to wait for the GUI one.
+// The frame is latched into the texture by now, so probes and analysis
+// surfaces read it back here. The copy of the analysis outputs keeps one
+// removed meanwhile alive until it is read back; frames are presented on the
+// GUI thread.
+void AalVideoRendererControl::frameRendered(qint64 sequence, qint64 latency)
+{
+    m_statistics.addSample(AalFrameStatistics::PresentToRender, latency);
+
+    AalVideoProber *prober = m_service->videoProber();
+    if (prober && prober->isActive()) {
+        prober->mapLatched(sequence);
+    }
+
+    QList<std::shared_ptr<AalVideoOutput> > outputs;
+    {
+        QMutexLocker locker(&m_analysisOutputsMutex);
+        outputs = m_analysisOutputs;
+    }
+    if (outputs.isEmpty()) {
+        return;
+    }
+    if (!QOpenGLContext::currentContext()) {
+        qWarning() << "No OpenGL context current on the render thread, cannot map analysis frames";
+        return;
+    }
+
+    bool latched = false;
+    Q_FOREACH(const std::shared_ptr<AalVideoOutput> &output, outputs) {
+        latched = output->mapLatched(sequence) || latched;
+    }
+    if (latched) {
+        QMetaObject::invokeMethod(this, "presentAnalysisFrames", Qt::QueuedConnection);
+    }
+}
+
+void AalVideoRendererControl::textureLatchesSkipped(int count)
+{
+    m_skippedLatches.fetchAndAddRelaxed(count);
+}
+
 void AalVideoRendererControl::onSnapshotTaken(QImage snapshotImage)
 {
-    m_preview = snapshotImage;
+    m_preview = std::move(snapshotImage);
     Q_EMIT previewReady();
 }
 
+void AalVideoRendererControl::onFrameAvailable()
+{
+    // Clear the flag first: a frame arriving while this one is presented
+    // has to queue a new update
+    m_frameUpdatePending.storeRelease(0);
+    updateViewfinderFrame();
+}
+
 void AalVideoRendererControl::updateViewfinderFrameCB(void* context)
 {
-    Q_UNUSED(context);
-    AalVideoRendererControl *self = AalCameraService::instance()->videoOutputControl();
-    if (self->m_previewStarted) {
-        QMetaObject::invokeMethod(self, "updateViewfinderFrame", Qt::QueuedConnection);
+    AalVideoRendererControl *self = AalCameraService::fromContext(context)->videoOutputControl();
+
+    // Every callback queued a buffer, which the video node has to latch
+    self->m_channel->frameArrived();
+
+    if (!self->m_previewStarted.loadAcquire()) {
+        self->m_droppedFrames.ref();
+        return;
+    }
+
+    // Keep at most one update queued, so that a busy GUI thread does not
+    // replay a backlog of frames when it gets back to its event loop
+    if (self->m_frameUpdatePending.testAndSetAcquire(0, 1)) {
+        QMetaObject::invokeMethod(self, "onFrameAvailable", Qt::QueuedConnection);
+    } else {
+        self->m_coalescedFrames.ref();
+    }
+}
+
+void AalVideoRendererControl::previewFrameCB(void* data, uint32_t dataSize, void* context)
+{
+    AalVideoRendererControl *self = AalCameraService::fromContext(context)->videoOutputControl();
+    if (!self->m_previewStarted.loadAcquire() || !self->m_previewCallbackActive.loadAcquire()) {
+        return;
     }
+
+    QSize size;
+    {
+        QMutexLocker locker(&self->m_previewSizeMutex);
+        size = self->m_previewSize;
+    }
+
+    // The pool bounds the frames waiting for the GUI thread: once all of
+    // its buffers are queued or in use, new frames are dropped
+    QVideoFrame frame = self->m_previewFramePool.frame(data, dataSize, size);
+    if (!frame.isValid()) {
+        self->m_droppedFrames.ref();
+        return;
+    }
+    frame.setStartTime(CameraChannel::monotonicTime());
+
+    QMetaObject::invokeMethod(self, "presentPreviewFrame", Qt::QueuedConnection,
+                              Q_ARG(QVideoFrame, frame));
 }
 
 const QImage &AalVideoRendererControl::preview() const
@@ -668,6 +620,5 @@ void AalVideoRendererControl::createPreview()
         return;
 
     QSize vfSize = m_service->viewfinderControl()->currentSize();
-    SharedSignal::instance()->setSnapshotSize(vfSize);
-    SharedSignal::instance()->takeSnapshot(m_service->androidControl());
+    m_channel->requestSnapshot(vfSize);
 }
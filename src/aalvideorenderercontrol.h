@@ -17,19 +17,42 @@
 #ifndef AALVIDEORENDERERCONTROL_H
 #define AALVIDEORENDERERCONTROL_H
 
+#include "aalframestatistics.h"
+#include "aalpreviewframepool.h"
+#include "camera_channel.h"
+
+#include <QAtomicInt>
 #include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <QVideoFrame>
 #include <QVideoRendererControl>
 #include <qgl.h>
 
+#include <memory>
+#include <stdint.h>
+
 class AalCameraService;
 struct CameraControl;
 struct CameraControlListener;
-class AalTextureBufferMapper;
+class AalVideoOutput;
 
-class AalVideoRendererControl : public QVideoRendererControl
+class AalVideoRendererControl : public QVideoRendererControl, private CameraChannel::Receiver
 {
     Q_OBJECT
+    Q_PROPERTY(ReadbackMode readbackMode READ readbackMode WRITE setReadbackMode NOTIFY readbackModeChanged)
+    Q_PROPERTY(QSize analysisSize READ analysisSize WRITE setAnalysisSize NOTIFY analysisSizeChanged)
+    Q_PROPERTY(QRect analysisCrop READ analysisCrop WRITE setAnalysisCrop NOTIFY analysisCropChanged)
+    Q_PROPERTY(bool previewCallbackEnabled READ isPreviewCallbackEnabled WRITE setPreviewCallbackEnabled NOTIFY previewCallbackEnabledChanged)
+    Q_PROPERTY(QObjectList analysisSurfaces READ analysisSurfaces NOTIFY analysisSurfacesChanged)
 public:
+    enum ReadbackMode {
+        ExactReadback,
+        LatestReadback,
+        NonBlockingReadback
+    };
+    Q_ENUM(ReadbackMode)
+
     AalVideoRendererControl(AalCameraService *service, QObject *parent = 0);
     ~AalVideoRendererControl();
 
@@ -37,12 +60,36 @@ public:
     void setSurface(QAbstractVideoSurface *surface);
 
     static void updateViewfinderFrameCB(void *context);
+    static void previewFrameCB(void *data, uint32_t dataSize, void *context);
 
     const QImage &preview() const;
     void createPreview();
 
     bool isPreviewStarted() const;
 
+    ReadbackMode readbackMode() const;
+    void setReadbackMode(ReadbackMode mode);
+
+    QSize analysisSize() const;
+    void setAnalysisSize(const QSize &size);
+    QRect analysisCrop() const;
+    void setAnalysisCrop(const QRect &rect);
+
+    bool isPreviewCallbackEnabled() const;
+    void setPreviewCallbackEnabled(bool enabled);
+
+    int coalescedFrameCount() const;
+    int droppedFrameCount() const;
+    int skippedLatchCount() const;
+    Q_INVOKABLE QVariantMap frameStatistics() const;
+    Q_INVOKABLE void resetFrameCounters();
+
+    Q_INVOKABLE void addAnalysisSurface(QAbstractVideoSurface *surface, const QSize &size = QSize(),
+                                        const QRect &crop = QRect(), ReadbackMode mode = ExactReadback,
+                                        qreal maxFrameRate = 0);
+    Q_INVOKABLE void removeAnalysisSurface(QAbstractVideoSurface *surface);
+    QObjectList analysisSurfaces() const;
+
 public Q_SLOTS:
     void init(CameraControl *control, CameraControlListener *listener);
     void startPreview();
@@ -51,21 +98,63 @@ public Q_SLOTS:
 Q_SIGNALS:
     void surfaceChanged(QAbstractVideoSurface *surface);
     void previewReady();
+    void readbackModeChanged(ReadbackMode mode);
+    void analysisSizeChanged(const QSize &size);
+    void analysisCropChanged(const QRect &rect);
+    void previewCallbackEnabledChanged(bool enabled);
+    void analysisSurfacesChanged();
 
 private Q_SLOTS:
     void updateViewfinderFrame();
+    void onFrameAvailable();
+    void presentPreviewFrame(const QVideoFrame &frame);
+    void presentAnalysisFrames();
     void onTextureCreated(unsigned int textureID);
     void onSnapshotTaken(QImage snapshotImage);
 
 private:
+    // CameraChannel::Receiver, called on the render thread
+    void textureCreated(unsigned int textureId) override;
+    void snapshotTaken(QImage image) override;
+    void frameRendered(qint64 sequence, qint64 latency) override;
+    void textureLatchesSkipped(int count) override;
+
+    void updatePreviewCallbackMode();
+
     QAbstractVideoSurface *m_surface;
     AalCameraService *m_service;
-    AalTextureBufferMapper* m_mapper;
+    AalVideoOutput *m_output;
+    // Changed on the GUI thread, the render thread maps frames for a copy
+    QMutex m_analysisOutputsMutex;
+    QList<std::shared_ptr<AalVideoOutput> > m_analysisOutputs;
 
     bool m_viewFinderRunning;
-    bool m_previewStarted;
+    // Read by the HAL callbacks
+    QAtomicInt m_previewStarted;
     GLuint m_textureId;
     QImage m_preview;
+    CameraChannelPtr m_channel;
+
+    // Set while an update is queued to the GUI thread, so that frames
+    // arriving meanwhile are coalesced into it
+    QAtomicInt m_frameUpdatePending;
+    QAtomicInt m_coalescedFrames;
+    QAtomicInt m_droppedFrames;
+    QAtomicInt m_skippedLatches;
+
+    // Sequence number of the latest HAL frame callback presented, the
+    // callbacks themselves are counted by m_channel
+    qint64 m_presentedSequence;
+    AalFrameStatistics m_statistics;
+
+    // NV21 frames from the HAL preview callback, for surfaces taking them.
+    // The callback is only active while such a surface is attached.
+    bool m_previewCallbackEnabled;
+    QAtomicInt m_previewCallbackActive;
+    AalPreviewFramePool m_previewFramePool;
+    // Viewfinder size of the running preview, for the HAL preview callback
+    mutable QMutex m_previewSizeMutex;
+    QSize m_previewSize;
 };
 
 #endif
@@ -0,0 +1 @@
+../sharedsignal/camera_channel.h
\ No newline at end of file
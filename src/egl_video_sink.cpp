@@ -17,29 +17,287 @@
  */
 
 #include "egl_video_sink.h"
+#include "media_signals.h"
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <mutex>
 #include <sstream>
 #include <thread>
 #include <future>
 #include <cstring>
 #include <unistd.h>
+#include <vector>
 
 using namespace std;
 
+#ifndef EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT
+#define EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT 0x3443
+#define EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT 0x3444
+#define EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT 0x3445
+#define EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT 0x3446
+#define EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT 0x3447
+#define EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT 0x3448
+#endif
+
+// Time the producer has to describe its buffers before it is reported missing
+static const int descriptor_timeout_ms = 5000;
+
+// Size of the descriptor sent by producers without a buffer queue
+static const size_t single_buffer_meta_size = offsetof(BufferMetadata, index);
+// Size of the descriptor sent by producers without multi-plane support
+static const size_t single_plane_meta_size = offsetof(BufferMetadata, plane_count);
+
+// EGL attributes of each plane: fd, offset, pitch, modifier low and high bits
+static const EGLint plane_attributes[max_buffer_planes][5] = {
+    { EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+};
+
+/* EGLImages of the dma-bufs imported so far, shared by all sinks.
+ * Producers cycling through a fixed set of buffers, or describing them
+ * again to a new sink, get the images back without another import. Buffers
+ * are identified by the device and inode of their dma-bufs, along with the
+ * layout they are described with.
+ * That takes Linux 5.3 or newer, where each dma-buf has an inode of its own.
+ * Older kernels back all of them with the single anonymous inode, which
+ * eventfds use too, so every buffer would get the same key. The cache turns
+ * itself off for good when it sees that inode, or distinct buffers of a
+ * queue with the same key, and buffers are then imported every time.
+ * Images no sink uses are destroyed when there are too many of them, least
+ * recently used first, and all of them when the video sink is reset.
+ */
+class EglImageCache
+{
+public:
+    typedef vector<uint64_t> Key;
+
+    static EglImageCache &instance()
+    {
+        static EglImageCache cache;
+        return cache;
+    }
+
+    // Returns false if the dma-bufs of the buffer cannot be identified
+    bool key_of(const BufferData *data, Key *key)
+    {
+        const BufferMetadata &meta = data->meta;
+
+        if (!enabled.load())
+            return false;
+
+        key->assign({
+            static_cast<uint64_t>(meta.width),
+            static_cast<uint64_t>(meta.height),
+            static_cast<uint64_t>(meta.fourcc),
+            static_cast<uint64_t>(meta.plane_count),
+            static_cast<uint64_t>(meta.color_space),
+            static_cast<uint64_t>(meta.color_range),
+        });
+
+        for (int i = 0; i < meta.plane_count; ++i) {
+            struct stat st;
+            if (fstat(data->plane_fd(i), &st) == -1)
+                return false;
+            if (has_anon_inode && st.st_dev == anon_dev && st.st_ino == anon_ino) {
+                disable("dma-bufs share the anonymous inode");
+                return false;
+            }
+
+            const BufferPlane &plane = meta.planes[i];
+            key->insert(key->end(), {
+                static_cast<uint64_t>(st.st_dev),
+                static_cast<uint64_t>(st.st_ino),
+                static_cast<uint64_t>(plane.offset),
+                static_cast<uint64_t>(plane.stride),
+                plane.modifier,
+            });
+        }
+
+        return true;
+    }
+
+    // Returns the image of the key, which the caller uses until it is
+    // released, or EGL_NO_IMAGE_KHR if there is none
+    EGLImageKHR acquire(const Key &key, EGLDisplay display)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->display == display && !it->stale && it->key == key) {
+                it->users++;
+                entries.splice(entries.begin(), entries, it);
+                return it->image;
+            }
+        }
+
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    // Adds an image the caller just created, and uses until it is released
+    void insert(const Key &key, EGLDisplay display, EGLImageKHR image)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+
+        entries.push_front(Entry{key, display, image, 1, false});
+        evict();
+    }
+
+    void release(EGLImageKHR image)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->image == image) {
+                it->users--;
+                break;
+            }
+        }
+        evict();
+    }
+
+    // Turns caching off if distinct buffers of a queue have the same key
+    void check_queue(vector<Key> keys)
+    {
+        sort(keys.begin(), keys.end());
+        if (adjacent_find(keys.begin(), keys.end()) != keys.end())
+            disable("buffers of a queue share their dma-buf inodes");
+    }
+
+    // Images in use are destroyed once released, instead of being reused
+    void invalidate()
+    {
+        lock_guard<mutex> lock(cache_mutex);
+
+        for (Entry &entry : entries)
+            entry.stale = true;
+        evict();
+    }
+
+private:
+    struct Entry
+    {
+        Key key;
+        EGLDisplay display;
+        EGLImageKHR image;
+        int users;
+        bool stale;
+    };
+
+    // Unused images kept around, enough for a few buffer queues
+    static const size_t max_unused_images = 16;
+
+    EglImageCache():
+        enabled{true},
+        has_anon_inode{false},
+        destroy_image{(PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR")}
+    {
+        QObject::connect(SharedSignal::instance(), &SharedSignal::sinkReset,
+                         [this]() { invalidate(); });
+
+        int fd = eventfd(0, EFD_CLOEXEC);
+        if (fd != -1) {
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                anon_dev = st.st_dev;
+                anon_ino = st.st_ino;
+                has_anon_inode = true;
+            }
+            close(fd);
+        }
+    }
+
+    // Images left at exit go away with the EGL display
+    ~EglImageCache() = default;
+
+    void disable(const char *reason)
+    {
+        if (enabled.exchange(false)) {
+            qWarning("Not caching imported images, %s", reason);
+            invalidate();
+        }
+    }
+
+    void evict()
+    {
+        size_t unused = 0;
+
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->users > 0) {
+                ++it;
+                continue;
+            }
+
+            if (it->stale || ++unused > max_unused_images) {
+                destroy_image(it->display, it->image);
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    atomic<bool> enabled;
+    // Inode of anonymous files, shared by dma-bufs before Linux 5.3
+    bool has_anon_inode;
+    dev_t anon_dev;
+    ino_t anon_ino;
+
+    mutex cache_mutex;
+    list<Entry> entries;  // most recently used first
+    PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+};
+
 class EglVideoSinkPrivate: public VideoSinkPrivate
 {
     friend class EglVideoSink;
 
-    static bool receive_buff(int socket, BufferData *data)
+    // Buffer of the queue, with the image it is imported as
+    struct Buffer
+    {
+        BufferData data;
+        EGLImageKHR egl_image;
+        bool cached;  // image owned by the EglImageCache
+    };
+
+    // Buffer no longer displayed, returned to the producer once the GPU
+    // is done reading it
+    struct RetiredBuffer
+    {
+        int index;
+        EGLSyncKHR fence;
+        uint64_t swap;
+    };
+
+    // Swaps a retired buffer waits for when there is no fence to tell when
+    // the GPU is done with it, as drivers queue up to two frames
+    static const uint64_t unfenced_release_swaps = 2;
+
+    static bool receive_buff(int socket, BufferData *data,
+                             struct sockaddr_un *producer,
+                             socklen_t *producer_len)
     {
         struct msghdr msg{};
         struct iovec io = { .iov_base = &data->meta,
@@ -47,6 +305,9 @@ class EglVideoSinkPrivate: public VideoSinkPrivate
         char c_buffer[256];
         ssize_t res;
 
+        msg.msg_name = producer;
+        msg.msg_namelen = sizeof *producer;
+
         msg.msg_iov = &io;
         msg.msg_iovlen = 1;
 
@@ -59,36 +320,188 @@ class EglVideoSinkPrivate: public VideoSinkPrivate
         } else if (res == 0) {
             qCritical("Socket shutdown while receiving buffer data");
             return false;
+        } else if (static_cast<size_t>(res) < single_buffer_meta_size) {
+            qCritical("Buffer description too short: %zd bytes", res);
+            return false;
+        }
+
+        if (static_cast<size_t>(res) < single_plane_meta_size) {
+            // Producer without a buffer queue
+            data->meta.index = 0;
+            data->meta.count = 1;
+        }
+
+        if (static_cast<size_t>(res) < sizeof data->meta) {
+            // Producer without multi-plane support
+            data->meta.plane_count = 1;
+            data->meta.planes[0].offset = data->meta.offset;
+            data->meta.planes[0].stride = data->meta.stride;
+            data->meta.planes[0].modifier = buffer_modifier_invalid;
+            data->meta.color_space = BufferColorSpaceDefault;
+            data->meta.color_range = BufferColorRangeDefault;
         }
 
         struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+            qCritical("No buffer fd in buffer description");
+            return false;
+        }
 
-        memmove(&data->fd, CMSG_DATA(cmsg), sizeof data->fd);
+        const size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (fd_count == 0 || fd_count > max_buffer_planes) {
+            qCritical("Unexpected number of buffer fds: %zu", fd_count);
+            return false;
+        }
+
+        data->fd_count = fd_count;
+        memmove(data->fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+        *producer_len = msg.msg_namelen;
+
+        if (data->meta.plane_count < 1 || data->meta.plane_count > max_buffer_planes) {
+            qCritical("Unexpected number of planes: %d", data->meta.plane_count);
+            close_fds(data);
+            return false;
+        }
 
-        qDebug("Extracted fd %d", data->fd);
+        qDebug("Extracted %d fds, first %d", data->fd_count, data->fds[0]);
         qDebug("width    %d", data->meta.width);
         qDebug("height   %d", data->meta.height);
         qDebug("fourcc 0x%X", data->meta.fourcc);
-        qDebug("stride   %d", data->meta.stride);
-        qDebug("offset   %d", data->meta.offset);
+        for (int i = 0; i < data->meta.plane_count; ++i) {
+            qDebug("plane %d: stride %d offset %d", i,
+                   data->meta.planes[i].stride, data->meta.planes[i].offset);
+        }
+        qDebug("index    %d of %d", data->meta.index, data->meta.count);
+
+        return true;
+    }
+
+    static void close_fds(const BufferData *data)
+    {
+        for (int i = 0; i < data->fd_count; ++i)
+            close(data->fds[i]);
+    }
+
+    // Reads one buffer description. Once all buffers are described, they
+    // are handed over to the rendering thread, which imports them on its
+    // next swap. Returns the number of buffers, 0 while some are missing,
+    // -1 on error.
+    static int read_description(int sock_fd,
+                                vector<BufferData> &buffers,
+                                EglVideoSinkPrivate *d,
+                                EglVideoSink *q)
+    {
+        BufferData buff_data;
+        struct sockaddr_un producer;
+        socklen_t producer_len = 0;
+
+        const bool received = receive_buff(sock_fd, &buff_data, &producer, &producer_len);
+        if (!received || buff_data.meta.count <= 0 ||
+            buff_data.meta.index != static_cast<int>(buffers.size())) {
+            if (received)
+                close_fds(&buff_data);
+            d->fail("Invalid buffer description from the video producer");
+            return -1;
+        }
+
+        buffers.push_back(buff_data);
+
+        {
+            lock_guard<mutex> lock(d->queue_mutex);
+            d->producer = producer;
+            d->producer_len = producer_len;
+        }
+
+        const int count = buffers.front().meta.count;
+        if (static_cast<int>(buffers.size()) < count)
+            return 0;
+
+        {
+            lock_guard<mutex> lock(d->queue_mutex);
+            d->received_buffers.swap(buffers);
+        }
+        Q_EMIT q->frameAvailable();
+
+        return count;
+    }
+
+    // Reads all pending frame syncs, and signals them as a single frame,
+    // the older ones being skipped. Returns false on error.
+    static bool read_syncs(int sock_fd, int count,
+                           EglVideoSinkPrivate *d,
+                           EglVideoSink *q)
+    {
+        static const int batch_size = 16;
+
+        BufferSync syncs[batch_size];
+        struct iovec iovs[batch_size];
+        struct mmsghdr msgs[batch_size];
+        vector<int> indices;
 
+        while (true) {
+            memset(msgs, 0, sizeof msgs);
+            for (int i = 0; i < batch_size; ++i) {
+                iovs[i].iov_base = &syncs[i];
+                iovs[i].iov_len = sizeof syncs[i];
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            const int n = recvmmsg(sock_fd, msgs, batch_size, MSG_DONTWAIT, nullptr);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                qCritical("while waiting sync: %s (%d)",
+                         strerror(errno), errno);
+                return false;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                // Producers without a buffer queue send a single byte
+                const int index = msgs[i].msg_len < sizeof syncs[i] ? 0 : syncs[i].index;
+                if (index < 0 || index >= count) {
+                    qWarning("Sync for unknown buffer %d", index);
+                    continue;
+                }
+                indices.push_back(index);
+            }
+
+            if (n < batch_size)
+                break;
+        }
+
+        if (indices.empty())
+            return true;
+
+        {
+            lock_guard<mutex> lock(d->queue_mutex);
+            d->ready.insert(d->ready.end(), indices.begin(), indices.end());
+        }
+
+        Q_EMIT q->frameAvailable(static_cast<int>(indices.size()) - 1);
         return true;
     }
 
     static void read_sock_events(PlayerKey key,
                                  int sock_fd,
-                                 promise<BufferData>& prom_buff,
+                                 int event_fd,
+                                 EglVideoSinkPrivate *d,
                                  EglVideoSink *q)
     {
         static const char *consumer_socket = "media-consumer";
 
         struct sockaddr_un local;
         int len;
-        BufferData buff_data;
+        vector<BufferData> buffers;
+        int count = 0;
+        bool reported_late = false;
 
-        if (sock_fd == -1) {
-            qCritical("Cannot create buffer consumer socket: %s (%d)",
-                     strerror(errno), errno);
+        if (sock_fd == -1 || event_fd == -1) {
+            ostringstream oss;
+            oss << "Cannot create buffer consumer socket: " << strerror(errno);
+            d->fail(oss.str());
             return;
         }
 
@@ -99,34 +512,79 @@ class EglVideoSinkPrivate: public VideoSinkPrivate
         strcpy(local.sun_path + 1, sock_name_ss.str().c_str());
         len = sizeof(local.sun_family) + sock_name_ss.str().length() + 1;
         if (bind(sock_fd, (struct sockaddr *) &local, len) == -1) {
-            qCritical("Cannot bind consumer socket: %s (%d)",
-                     strerror(errno), errno);
+            ostringstream oss;
+            oss << "Cannot bind consumer socket: " << strerror(errno);
+            d->fail(oss.str());
             return;
         }
 
-        // Wait for buffer descriptions, pass them to rendering thread
-        if (!receive_buff(sock_fd, &buff_data))
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            ostringstream oss;
+            oss << "Cannot create consumer event queue: " << strerror(errno);
+            d->fail(oss.str());
             return;
+        }
 
-        prom_buff.set_value(buff_data);
+        struct epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = sock_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+        event.data.fd = event_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
 
-        // Now signal frame syncs
-        while(true) {
-            ssize_t res;
-            char c;
+        // Read buffer descriptions, then frame syncs, until the sink goes
+        // away. A producer late with its descriptions is reported once, but
+        // may still show up.
+        while (true) {
+            struct epoll_event events[2];
+            const int timeout = (count == 0 && !reported_late) ? descriptor_timeout_ms : -1;
 
-            res = recv(sock_fd, &c, sizeof c, 0);
-            if (res == -1) {
-                qCritical("while waiting sync: %s (%d)",
-                         strerror(errno), errno);
-                return;
-            } else if (res == 0) {
-                qDebug("Socket shutdown");
-                return;
+            const int n = epoll_wait(epoll_fd, events, 2, timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                ostringstream oss;
+                oss << "Failed to wait for the video producer: " << strerror(errno);
+                d->fail(oss.str());
+                break;
+            } else if (n == 0) {
+                d->report_error("No buffer description received from the video producer");
+                reported_late = true;
+                continue;
+            }
+
+            bool readable = false;
+            bool stopped = false;
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == event_fd)
+                    stopped = true;
+                else
+                    readable = true;
             }
 
-            Q_EMIT q->frameAvailable();
+            if (stopped) {
+                qDebug("Consumer socket closed");
+                break;
+            }
+
+            if (!readable)
+                continue;
+
+            if (count == 0) {
+                count = read_description(sock_fd, buffers, d, q);
+                if (count == -1)
+                    break;
+            } else if (!read_syncs(sock_fd, count, d, q)) {
+                break;
+            }
         }
+
+        // Described, but not handed over
+        for (const BufferData &data : buffers)
+            close_fds(&data);
+
+        close(epoll_fd);
     }
 
     bool find_extension(const string& extensions, const string& ext)
@@ -146,16 +604,16 @@ class EglVideoSinkPrivate: public VideoSinkPrivate
     }
 
 public:
-    EglVideoSinkPrivate(uint32_t gl_texture, PlayerKey key,
-                        EglVideoSink *q):
+    EglVideoSinkPrivate(uint32_t gl_texture, EglVideoSink *q):
         gl_texture{gl_texture},
-        prom_buff{},
-        fut_buff{prom_buff.get_future()},
-        sock_fd{socket(AF_UNIX, SOCK_DGRAM, 0)},
-        sock_thread{read_sock_events, key, sock_fd,
-            ref(prom_buff), q},
-        egl_image{EGL_NO_IMAGE_KHR},
-        buf_fd{-1}
+        q{q},
+        failed{false},
+        producer{},
+        producer_len{0},
+        sock_fd{socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)},
+        event_fd{eventfd(0, EFD_CLOEXEC)},
+        current{-1},
+        swaps{0}
     {
         const char *extensions;
         const char *egl_needed[] = {"EGL_KHR_image_base",
@@ -203,78 +661,317 @@ public:
         if (_eglCreateImageKHR == nullptr || _eglDestroyImageKHR == nullptr ||
             _glEGLImageTargetTexture2DOES == nullptr)
             throw runtime_error {"Error when loading extensions"};
+
+        // Optional: without fences, buffers are released two swaps later
+        _eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)
+            eglGetProcAddress("eglCreateSyncKHR");
+        _eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)
+            eglGetProcAddress("eglDestroySyncKHR");
+        _eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)
+            eglGetProcAddress("eglClientWaitSyncKHR");
+    }
+
+    // Called by EglVideoSink once it is fully constructed, since the socket
+    // thread emits its signals
+    void start(PlayerKey key)
+    {
+        sock_thread = thread{read_sock_events, key, sock_fd, event_fd, this, q};
     }
 
     ~EglVideoSinkPrivate()
     {
-        if (sock_fd != -1) {
-            shutdown(sock_fd, SHUT_RDWR);
+        // Wakes the socket thread up, whatever it is waiting for
+        if (sock_thread.joinable()) {
+            const uint64_t stop = 1;
+            if (event_fd == -1 || write(event_fd, &stop, sizeof stop) != sizeof stop)
+                shutdown(sock_fd, SHUT_RDWR);
             sock_thread.join();
+        }
+
+        if (sock_fd != -1)
             close(sock_fd);
+        if (event_fd != -1)
+            close(event_fd);
+
+        EGLDisplay egl_display = eglGetCurrentDisplay();
+        for (const RetiredBuffer &retired : retired_buffers) {
+            if (retired.fence != EGL_NO_SYNC_KHR)
+                _eglDestroySyncKHR(egl_display, retired.fence);
         }
 
-        if (buf_fd != -1)
-            close(buf_fd);
+        destroy_buffers();
+
+        // Described, but never imported
+        for (const BufferData &data : received_buffers)
+            close_fds(&data);
+    }
 
-        if (egl_image != EGL_NO_IMAGE_KHR)
-            _eglDestroyImageKHR(eglGetCurrentDisplay(), egl_image);
+    // Logs an error and tells the clients of the sink about it
+    void report_error(const string &message)
+    {
+        qCritical("%s", message.c_str());
+        Q_EMIT q->error(QString::fromStdString(message));
+    }
+
+    // Reports an error after which the sink cannot show any frame
+    void fail(const string &message)
+    {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            failed = true;
+        }
+        report_error(message);
+    }
+
+    void destroy_buffers()
+    {
+        EGLDisplay egl_display = eglGetCurrentDisplay();
+
+        for (const Buffer &buffer : buffers) {
+            if (buffer.egl_image != EGL_NO_IMAGE_KHR) {
+                if (buffer.cached)
+                    EglImageCache::instance().release(buffer.egl_image);
+                else
+                    _eglDestroyImageKHR(egl_display, buffer.egl_image);
+            }
+            close_fds(&buffer.data);
+        }
+        buffers.clear();
     }
 
     // This imports dma_buf buffers by using the EGL_EXT_image_dma_buf_import
     // extension. The buffers have been previously exported in mirsink, using
     // EGL_MESA_image_dma_buf_export extension. After that, we bind the buffer
     // to the app texture by using GL_OES_EGL_image_external extension.
-    bool import_buffer(const BufferData *buf_data)
+    // YUV buffers are imported as they are, the conversion to RGB happens
+    // when the external texture is sampled.
+    // Buffers imported before, by this sink or another one, reuse their
+    // image.
+    EGLImageKHR import_buffer(const BufferData *buf_data, bool *cached)
     {
-        GLenum err;
         EGLDisplay egl_display = eglGetCurrentDisplay();
-        EGLint image_attrs[] = {
-            EGL_WIDTH, buf_data->meta.width,
-            EGL_HEIGHT, buf_data->meta.height,
-            EGL_LINUX_DRM_FOURCC_EXT, buf_data->meta.fourcc,
-            EGL_DMA_BUF_PLANE0_FD_EXT, buf_data->fd,
-            EGL_DMA_BUF_PLANE0_OFFSET_EXT, buf_data->meta.offset,
-            EGL_DMA_BUF_PLANE0_PITCH_EXT, buf_data->meta.stride,
-            EGL_NONE
+        const BufferMetadata &meta = buf_data->meta;
+
+        EglImageCache::Key key;
+        *cached = EglImageCache::instance().key_of(buf_data, &key);
+        if (*cached) {
+            EGLImageKHR egl_image = EglImageCache::instance().acquire(key, egl_display);
+            if (egl_image != EGL_NO_IMAGE_KHR) {
+                qDebug("Image %d found in the import cache", meta.index);
+                return egl_image;
+            }
+        }
+
+        vector<EGLint> image_attrs = {
+            EGL_WIDTH, meta.width,
+            EGL_HEIGHT, meta.height,
+            EGL_LINUX_DRM_FOURCC_EXT, meta.fourcc,
         };
 
-        buf_fd = buf_data->fd;
-        egl_image = _eglCreateImageKHR(egl_display, EGL_NO_CONTEXT,
-                                       EGL_LINUX_DMA_BUF_EXT, NULL, image_attrs);
+        for (int i = 0; i < meta.plane_count; ++i) {
+            const BufferPlane &plane = meta.planes[i];
+            image_attrs.insert(image_attrs.end(), {
+                plane_attributes[i][0], buf_data->plane_fd(i),
+                plane_attributes[i][1], plane.offset,
+                plane_attributes[i][2], plane.stride,
+            });
+
+            // Needs EGL_EXT_image_dma_buf_import_modifiers, only sent for
+            // tiled or compressed layouts
+            if (plane.modifier != buffer_modifier_invalid) {
+                image_attrs.insert(image_attrs.end(), {
+                    plane_attributes[i][3], static_cast<EGLint>(plane.modifier & 0xffffffff),
+                    plane_attributes[i][4], static_cast<EGLint>(plane.modifier >> 32),
+                });
+            }
+        }
+
+        switch (meta.color_space) {
+        case BufferColorSpaceRec601:
+            image_attrs.insert(image_attrs.end(), { EGL_YUV_COLOR_SPACE_HINT_EXT, EGL_ITU_REC601_EXT });
+            break;
+        case BufferColorSpaceRec709:
+            image_attrs.insert(image_attrs.end(), { EGL_YUV_COLOR_SPACE_HINT_EXT, EGL_ITU_REC709_EXT });
+            break;
+        case BufferColorSpaceRec2020:
+            image_attrs.insert(image_attrs.end(), { EGL_YUV_COLOR_SPACE_HINT_EXT, EGL_ITU_REC2020_EXT });
+            break;
+        default:
+            break;
+        }
+
+        switch (meta.color_range) {
+        case BufferColorRangeFull:
+            image_attrs.insert(image_attrs.end(), { EGL_SAMPLE_RANGE_HINT_EXT, EGL_YUV_FULL_RANGE_EXT });
+            break;
+        case BufferColorRangeNarrow:
+            image_attrs.insert(image_attrs.end(), { EGL_SAMPLE_RANGE_HINT_EXT, EGL_YUV_NARROW_RANGE_EXT });
+            break;
+        default:
+            break;
+        }
+
+        image_attrs.push_back(EGL_NONE);
+
+        EGLImageKHR egl_image = _eglCreateImageKHR(egl_display, EGL_NO_CONTEXT,
+                                                   EGL_LINUX_DMA_BUF_EXT, NULL, image_attrs.data());
         if (egl_image == EGL_NO_IMAGE_KHR) {
             qCritical("eglCreateImageKHR error 0x%X", eglGetError());
-            return false;
+            return EGL_NO_IMAGE_KHR;
+        }
+
+        qDebug("Image %d successfully imported", buf_data->meta.index);
+
+        if (*cached)
+            EglImageCache::instance().insert(key, egl_display, egl_image);
+
+        return egl_image;
+    }
+
+    // Imports the buffers once they have all been described, without
+    // waiting for the producer
+    bool import_buffers()
+    {
+        vector<BufferData> received;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (failed || received_buffers.empty())
+                return false;
+            received.swap(received_buffers);
+        }
+
+        for (const BufferData &data : received) {
+            Buffer buffer{data, EGL_NO_IMAGE_KHR, false};
+            buffers.push_back(buffer);
+        }
+
+        // Before any of them is looked up in the cache
+        vector<EglImageCache::Key> keys;
+        for (const Buffer &buffer : buffers) {
+            EglImageCache::Key key;
+            if (EglImageCache::instance().key_of(&buffer.data, &key))
+                keys.push_back(key);
+        }
+        EglImageCache::instance().check_queue(keys);
+
+        for (Buffer &buffer : buffers) {
+            buffer.egl_image = import_buffer(&buffer.data, &buffer.cached);
+            if (buffer.egl_image == EGL_NO_IMAGE_KHR) {
+                destroy_buffers();
+                fail("Failed to import the video producer's buffers");
+                return false;
+            }
         }
 
-        // TODO Do this when swapping if we end up importing more than one buffer
-        glBindTexture(GL_TEXTURE_2D, gl_texture);
-        _glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, egl_image);
+        return true;
+    }
+
+    void bind_buffer(int index)
+    {
+        GLenum err;
+
+        // Images of YUV buffers can only be sampled as external textures
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, gl_texture);
+        _glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, buffers[index].egl_image);
 
         while((err = glGetError()) != GL_NO_ERROR)
             qWarning("OpenGL error 0x%X", err);
+    }
 
-        qDebug("Image successfully imported");
+    // The fence follows the commands of the frames the buffer was drawn in
+    void retire_buffer(int index)
+    {
+        EGLSyncKHR fence = EGL_NO_SYNC_KHR;
+        if (_eglCreateSyncKHR != nullptr)
+            fence = _eglCreateSyncKHR(eglGetCurrentDisplay(), EGL_SYNC_FENCE_KHR, nullptr);
 
-        return true;
+        retired_buffers.push_back(RetiredBuffer{index, fence, swaps});
+    }
+
+    void release_buffer(int index)
+    {
+        BufferRelease release{index};
+        struct sockaddr_un to;
+        socklen_t to_len;
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            to = producer;
+            to_len = producer_len;
+        }
+
+        // Producers that did not bind their socket cannot be answered
+        if (to_len <= sizeof(sa_family_t))
+            return;
+
+        if (sendto(sock_fd, &release, sizeof release, MSG_DONTWAIT,
+                   (struct sockaddr *) &to, to_len) == -1)
+            qWarning("Failed to release buffer %d: %s (%d)",
+                     index, strerror(errno), errno);
+    }
+
+    // Returns the retired buffers the GPU is done with to the producer
+    void release_retired_buffers()
+    {
+        EGLDisplay egl_display = eglGetCurrentDisplay();
+
+        for (auto it = retired_buffers.begin(); it != retired_buffers.end();) {
+            bool done;
+            if (it->fence != EGL_NO_SYNC_KHR) {
+                done = _eglClientWaitSyncKHR(egl_display, it->fence, 0, 0)
+                    == EGL_CONDITION_SATISFIED_KHR;
+                if (done)
+                    _eglDestroySyncKHR(egl_display, it->fence);
+            } else {
+                // Without fences, assume the GPU may still be drawing the
+                // frames queued before the last swaps
+                done = it->swap + unfenced_release_swaps <= swaps;
+            }
+
+            if (done) {
+                release_buffer(it->index);
+                it = retired_buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
     }
 
     uint32_t gl_texture;
-    promise<BufferData> prom_buff;
-    future<BufferData> fut_buff;
+    EglVideoSink *q;
+
+    // Shared with the socket thread
+    mutex queue_mutex;
+    bool failed;
+    vector<BufferData> received_buffers;
+    deque<int> ready;
+    struct sockaddr_un producer;
+    socklen_t producer_len;
+
     int sock_fd;
+    int event_fd;  // signalled to stop the socket thread
     thread sock_thread;
-    EGLImageKHR egl_image;
-    int buf_fd;
+
+    vector<Buffer> buffers;
+    vector<RetiredBuffer> retired_buffers;
+    int current;
+    uint64_t swaps;
+
     PFNEGLCREATEIMAGEKHRPROC _eglCreateImageKHR;
     PFNEGLDESTROYIMAGEKHRPROC _eglDestroyImageKHR;
     PFNGLEGLIMAGETARGETTEXTURE2DOESPROC _glEGLImageTargetTexture2DOES;
+    PFNEGLCREATESYNCKHRPROC _eglCreateSyncKHR;
+    PFNEGLDESTROYSYNCKHRPROC _eglDestroySyncKHR;
+    PFNEGLCLIENTWAITSYNCKHRPROC _eglClientWaitSyncKHR;
 };
 
 EglVideoSink::EglVideoSink(uint32_t gl_texture,
                            PlayerKey key,
                            QObject *parent):
-    VideoSink(new EglVideoSinkPrivate(gl_texture, key, this), parent)
+    VideoSink(new EglVideoSinkPrivate(gl_texture, this), parent)
 {
+    Q_D(EglVideoSink);
+    d->start(key);
 }
 
 EglVideoSink::~EglVideoSink()
@@ -292,15 +989,52 @@ bool EglVideoSink::swapBuffers()
 {
     Q_D(EglVideoSink);
 
-    // First time called, import buffers
-    if (d->egl_image == EGL_NO_IMAGE_KHR) {
-        BufferData buf_data = d->fut_buff.get();
-        if (!d->import_buffer(&buf_data))
+    // First time the buffers are described, import them. Until then there
+    // is nothing to show, and no reason to wait for the producer.
+    if (d->buffers.empty()) {
+        if (!d->import_buffers())
             return false;
     }
 
-    // We need to do nothing here, as the only buffer has already been mapped.
-    // TODO Change when we implement a buffer queue.
+    d->swaps++;
+
+    // Only the latest frame is shown, the ones queued before it are
+    // skipped and given back right away
+    int index = -1;
+    vector<int> skipped;
+    {
+        lock_guard<mutex> lock(d->queue_mutex);
+        if (!d->ready.empty()) {
+            index = d->ready.back();
+            skipped.assign(d->ready.begin(), d->ready.end() - 1);
+            d->ready.clear();
+        }
+    }
+
+    for (int skipped_index : skipped) {
+        if (skipped_index != index && skipped_index != d->current)
+            d->release_buffer(skipped_index);
+    }
+
+    if (index == -1) {
+        // No frame synced yet: a single buffer producer draws into its only
+        // buffer without telling
+        if (d->current == -1 && d->buffers.size() == 1) {
+            d->bind_buffer(0);
+            d->current = 0;
+        }
+        d->release_retired_buffers();
+        return d->current != -1;
+    }
+
+    // A single buffer is updated in place, and stays bound
+    if (index != d->current) {
+        d->bind_buffer(index);
+        if (d->current != -1)
+            d->retire_buffer(d->current);
+        d->current = index;
+    }
 
+    d->release_retired_buffers();
     return true;
 }
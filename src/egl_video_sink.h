@@ -19,6 +19,43 @@
 
 #include "video_sink_p.h"
 
+#include <cstdint>
+
+// Planes of multi-planar formats such as NV12 or YUV420
+static const int max_buffer_planes = 3;
+
+// Modifier of planes whose layout is implied by their format
+static const uint64_t buffer_modifier_invalid = 0x00ffffffffffffffULL;
+
+struct BufferPlane
+{
+    int offset;
+    int stride;
+    uint64_t modifier;
+};
+
+enum BufferColorSpace
+{
+    BufferColorSpaceDefault,
+    BufferColorSpaceRec601,
+    BufferColorSpaceRec709,
+    BufferColorSpaceRec2020
+};
+
+enum BufferColorRange
+{
+    BufferColorRangeDefault,
+    BufferColorRangeFull,
+    BufferColorRangeNarrow
+};
+
+/* Descriptor of one buffer of the producer's queue, sent along with the
+ * buffer's dma-buf fds before the first frame: one fd per plane, or a
+ * single one shared by all planes.
+ * Older producers stop after offset, for a single buffer with a single
+ * plane, or after count, for a queue of single plane buffers. stride and
+ * offset describe the first plane either way.
+ */
 struct BufferMetadata
 {
     int width;
@@ -26,12 +63,38 @@ struct BufferMetadata
     int fourcc;
     int stride;
     int offset;
+    int index;  // position of the buffer in the queue
+    int count;  // number of buffers in the queue
+    int plane_count;
+    BufferPlane planes[max_buffer_planes];
+    int color_space;  // BufferColorSpace, for YUV formats
+    int color_range;  // BufferColorRange, for YUV formats
 };
 
 struct BufferData
 {
-    int fd;
+    int fds[max_buffer_planes];
+    int fd_count;
     BufferMetadata meta;
+
+    // fd holding the given plane
+    int plane_fd(int plane) const { return plane < fd_count ? fds[plane] : fds[0]; }
+};
+
+/* Sent by the producer when a frame was written into a buffer. Producers
+ * without a buffer queue send a single byte instead.
+ */
+struct BufferSync
+{
+    int index;
+};
+
+/* Sent back to the producer when a buffer is no longer displayed, so that
+ * the next frames can be written into it.
+ */
+struct BufferRelease
+{
+    int index;
 };
 
 class EglVideoSinkPrivate;
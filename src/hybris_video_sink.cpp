@@ -17,7 +17,9 @@
  */
 
 #include "hybris_video_sink.h"
+#include "media_signals.h"
 
+#include <QAtomicInt>
 #include <QMutex>
 #include <QMutexLocker>
 
@@ -40,6 +42,7 @@ class HybrisVideoSinkPrivate: public VideoSinkPrivate
 public:
     HybrisVideoSinkPrivate(uint32_t gl_texture, HybrisVideoSink *q):
         gl_texture{gl_texture},
+        latch_mode{HybrisVideoSink::LatchInOrder},
         graphics_buffer_consumer{decoding_service_get_igraphicbufferconsumer()},
         gl_texture_consumer{gl_consumer_create_by_id_with_igbc(gl_texture, graphics_buffer_consumer)}
     {
@@ -72,7 +75,21 @@ public:
                                               m_transformationMatrix.data());
     }
 
+    // Latches the next buffer, releasing the previous one
+    void latch()
+    {
+        // TODO: The underlying API really should tell us if everything is ok.
+        gl_consumer_update_texture(gl_texture_consumer);
+    }
+
     uint32_t gl_texture;
+    // A HybrisVideoSink::LatchMode, read by the render thread
+    QAtomicInt latch_mode;
+
+    // Buffers queued and not latched yet, updated by the producer thread
+    // without waiting for the render thread
+    QAtomicInt pending;
+
     IGBCWrapperHybris graphics_buffer_consumer;
     GLConsumerWrapperHybris gl_texture_consumer;
 };
@@ -81,17 +98,24 @@ HybrisVideoSink::HybrisVideoSink(uint32_t gl_texture,
                                  QObject *parent):
     VideoSink(new HybrisVideoSinkPrivate(gl_texture, this), parent)
 {
+    connect(SharedSignal::instance(), &SharedSignal::setSinkLatchNewest, this,
+            [this](bool newest) { setLatchMode(newest ? LatchNewest : LatchInOrder); },
+            Qt::DirectConnection);
 }
 
 HybrisVideoSink::~HybrisVideoSink()
 {
 }
 
+// Called on the producer's thread for every queued buffer
 void HybrisVideoSink::onFrameAvailable()
 {
     Q_D(HybrisVideoSink);
-    d->updateTransformationMatrix();
-    Q_EMIT frameAvailable();
+
+    // Only the first buffer queued since the last latch wakes the render
+    // thread up, the next ones are counted for swapBuffers()
+    if (d->pending.fetchAndAddRelease(1) == 0)
+        Q_EMIT frameAvailable();
 }
 
 VideoSinkFactory HybrisVideoSink::createFactory(PlayerKey key)
@@ -117,7 +141,39 @@ bool HybrisVideoSink::swapBuffers()
 {
     Q_D(HybrisVideoSink);
 
-    // TODO: The underlying API really should tell us if everything is ok.
-    gl_consumer_update_texture(d->gl_texture_consumer);
+    if (d->latch_mode.loadAcquire() == LatchNewest) {
+        const int pending = d->pending.fetchAndStoreAcquire(0);
+        if (pending == 0)
+            return true;
+
+        for (int i = 0; i < pending; ++i)
+            d->latch();
+        if (pending > 1)
+            Q_EMIT SharedSignal::instance()->sinkFramesSkipped(pending - 1);
+    } else {
+        if (d->pending.loadAcquire() == 0)
+            return true;
+
+        d->latch();
+
+        // Buffers left in the queue need another wakeup
+        if (d->pending.fetchAndSubOrdered(1) > 1)
+            Q_EMIT frameAvailable();
+    }
+
+    // The matrix of the buffer just latched, not of the last one queued
+    d->updateTransformationMatrix();
     return true;
 }
+
+HybrisVideoSink::LatchMode HybrisVideoSink::latchMode() const
+{
+    Q_D(const HybrisVideoSink);
+    return static_cast<LatchMode>(d->latch_mode.loadAcquire());
+}
+
+void HybrisVideoSink::setLatchMode(LatchMode mode)
+{
+    Q_D(HybrisVideoSink);
+    d->latch_mode.storeRelease(mode);
+}
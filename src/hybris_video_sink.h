@@ -19,6 +19,8 @@
 
 #include "video_sink_p.h"
 
+#include <QtGlobal>
+
 typedef void* GLConsumerWrapperHybris;
 
 class HybrisVideoSinkPrivate;
@@ -27,11 +29,28 @@ class HybrisVideoSink: public VideoSink
     Q_OBJECT
 
 public:
+    /**
+     * @brief How swapBuffers() consumes the buffers queued since the
+     * previous call.
+     */
+    enum LatchMode {
+        LatchInOrder,  // one buffer per call, none is dropped
+        LatchNewest,   // the newest buffer, the older ones are dropped
+    };
+
     static VideoSinkFactory createFactory(PlayerKey playerKey);
     virtual ~HybrisVideoSink();
 
     bool swapBuffers() override;
 
+    /**
+     * @brief The mode follows SharedSignal::setSinkLatchNewest(), and may be
+     * set from any thread. Buffers dropped by LatchNewest are reported
+     * through SharedSignal::sinkFramesSkipped().
+     */
+    LatchMode latchMode() const;
+    void setLatchMode(LatchMode mode);
+
 private:
     HybrisVideoSink(uint32_t gl_texture, QObject *parent);
     void onFrameAvailable();
@@ -0,0 +1 @@
+../sharedsignal/shader_program_cache.h
\ No newline at end of file
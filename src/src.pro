@@ -29,6 +29,12 @@ HEADERS += \
     aalvideodeviceselectorcontrol.h \
     aalvideoencodersettingscontrol.h \
     aalvideorenderercontrol.h \
+    aaltexturebuffermapper.h \
+    aalframestatistics.h \
+    aalvideooutput.h \
+    aalpreviewframepool.h \
+    aalvideoprobecontrol.h \
+    aalvideoprober.h \
     aalviewfindersettingscontrol.h \
     aalcamerainfocontrol.h \
     audiocapture.h \
@@ -38,7 +44,9 @@ HEADERS += \
     video_sink.h \
     video_sink_p.h \
     egl_video_sink.h \
-    media_signals.h
+    camera_channel.h \
+    media_signals.h \
+    shader_program_cache.h
 
 SOURCES += \
     aalcameracontrol.cpp \
@@ -54,6 +62,12 @@ SOURCES += \
     aalvideodeviceselectorcontrol.cpp \
     aalvideoencodersettingscontrol.cpp \
     aalvideorenderercontrol.cpp \
+    aaltexturebuffermapper.cpp \
+    aalframestatistics.cpp \
+    aalvideooutput.cpp \
+    aalpreviewframepool.cpp \
+    aalvideoprobecontrol.cpp \
+    aalvideoprober.cpp \
     aalviewfindersettingscontrol.cpp \
     aalcamerainfocontrol.cpp \
     audiocapture.cpp \
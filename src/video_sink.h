@@ -20,6 +20,7 @@
 #include <QMatrix4x4>
 #include <QObject>
 #include <QScopedPointer>
+#include <QString>
 
 class VideoSinkPrivate;
 
@@ -50,9 +51,18 @@ public:
     /**
      * @brief The signal is emitted whenever a new frame is available and a subsequent
      * call to swapBuffers() will not block and return true.
+     * @param skippedFrames Number of older frames that arrived along with
+     * this one, and that will not be shown
      */
 Q_SIGNALS:
-    void frameAvailable();
+    void frameAvailable(int skippedFrames = 0);
+
+    /**
+     * @brief The signal is emitted when the sink cannot get frames from its
+     * source, or is still waiting for them after a timeout. It may be emitted
+     * from any thread.
+     */
+    void error(const QString &message);
 
 protected:
     VideoSink(VideoSinkPrivate *d, QObject *parent = nullptr);